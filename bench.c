@@ -0,0 +1,418 @@
+/*
+ * Dump pipeline benchmark.
+ *
+ * For every heap size and dump mode a child process is forked that builds
+ * a synthetic heap, starts worker threads that keep touching their own
+ * memory, and calls dump_core_self().  One JSON object per run is printed
+ * on stdout:
+ *
+ *   pause_ns        longest stall seen by any worker during the dump
+ *                   (the dump call itself when there are no workers)
+ *   wall_ns         time spent in dump_core_self()
+ *   bytes           size of the core file
+ *   bytes_per_sec   bytes / wall
+ *   rss_overhead_kb growth of peak RSS across the dump, plus the peak RSS
+ *                   of the dump helper when one is used
+ *   <phase>_ns      dump_stats time of each dump phase
+ *
+ *   gcc -m32 -O2 -DSEGMENT_NO_MAIN bench.c segment.c -o bench -lpthread
+ *   ./bench -s 1M,64M,1G -t 4 -p seq -m maps,chunks,helper-chunks
+ *
+ * Heap sizes beyond the address space (16G on i386) fail cleanly and are
+ * reported with "error".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "segment.h"
+
+#define MAX_SIZES       16
+#define MAX_MODES       16
+#define MAX_WORKERS     64
+
+#define TOUCH_NONE      0       /* allocate only                             */
+#define TOUCH_SEQ       1       /* write every page                          */
+#define TOUCH_SPARSE    2       /* write every 8th page                      */
+#define TOUCH_RANDOM    3       /* write half the pages in random order      */
+
+typedef struct bench_mode {
+        char *name;
+        int heap_dump_mode;
+        int helper;
+} BENCH_MODE;
+
+BENCH_MODE modes[] = {
+        { "maps",          HEAP_DUMP_MAPS,   0 },
+        { "chunks",        HEAP_DUMP_CHUNKS, 0 },
+        { "helper-maps",   HEAP_DUMP_MAPS,   1 },
+        { "helper-chunks", HEAP_DUMP_CHUNKS, 1 },
+        { NULL, 0, 0 }
+};
+
+char *patterns[] = { "none", "seq", "sparse", "random", NULL };
+char *io_names[] = { "cached", "dropbehind", "direct", NULL };
+char *sync_names[] = { "none", "data", "full", NULL };
+
+typedef struct bench_result {
+        int error;                    /* errno of a failed setup, 0 if ok    */
+        long long pause_ns;
+        long long wall_ns;
+        long long bytes;
+        long rss_overhead_kb;
+        DUMP_STATS stats;
+} RESULT;
+
+typedef struct worker {
+        pthread_t thread;
+        char *mem;
+        unsigned long size;
+        long long last;
+        long long max_gap;
+} WORKER;
+
+unsigned long long heap_size[MAX_SIZES];
+int nsize;
+BENCH_MODE *mode[MAX_MODES];
+int nmode;
+int nthread = 0;
+int touch = TOUCH_SEQ;
+unsigned long chunk = 64*1024;
+unsigned long worker_size = 1024*1024;
+int free_every = 2;
+int reps = 1;
+int copy_threads;
+int io = DUMP_IO_DROPBEHIND;
+int sync_mode = DUMP_SYNC_DATA;
+char *core_path = "bench.core";
+int keep_core;
+
+WORKER worker[MAX_WORKERS];
+volatile int dumping;
+volatile int stop;
+
+long long now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned long long parse_size(char *s)
+{
+        char *end;
+        unsigned long long v = strtoull(s, &end, 0);
+
+        switch(*end)
+        {
+                case 'g': case 'G': v <<= 10;
+                        /* fall through */
+                case 'm': case 'M': v <<= 10;
+                        /* fall through */
+                case 'k': case 'K': v <<= 10;
+        }
+        return v;
+}
+
+void touch_pages(char *mem, unsigned long size, int pattern)
+{
+        unsigned long npage = size / page_size, i;
+
+        switch(pattern)
+        {
+                case TOUCH_SEQ:
+                        for(i=0;i<npage;i++)
+                                mem[i*page_size] = (char)i;
+                        break;
+                case TOUCH_SPARSE:
+                        for(i=0;i<npage;i+=8)
+                                mem[i*page_size] = (char)i;
+                        break;
+                case TOUCH_RANDOM:
+                        for(i=0;i<npage/2;i++)
+                                mem[(rand() % npage)*page_size] = (char)i;
+                        break;
+        }
+}
+
+void *worker_main(void *arg)
+{
+        WORKER *w = (WORKER*)arg;
+        unsigned long pos = 0;
+        long long t;
+
+        w->mem = malloc(w->size);
+        if(!w->mem)
+                return NULL;
+        touch_pages(w->mem, w->size, touch);
+        w->last = now_ns();
+        while(!stop)
+        {
+                t = now_ns();
+                if(dumping && t - w->last > w->max_gap)
+                        w->max_gap = t - w->last;
+                w->last = t;
+                w->mem[pos]++;
+                pos = (pos + page_size) % w->size;
+        }
+        free(w->mem);
+        return NULL;
+}
+
+/* Peak RSS of pid in kB from /proc/<pid>/status, 0 if unknown */
+long vm_hwm(int pid)
+{
+        char path[64], buf[2048], *p;
+        int fd, n;
+
+        sprintf(path, "/proc/%d/status", pid);
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return 0;
+        n = read(fd, buf, sizeof(buf)-1);
+        close(fd);
+        buf[n > 0 ? n : 0] = 0;
+        p = strstr(buf, "VmHWM:");
+        return p ? atol(p + 6) : 0;
+}
+
+void run_child(int fd, BENCH_MODE *m, unsigned long long size)
+{
+        RESULT res;
+        struct rusage ru;
+        struct stat st;
+        unsigned long long n, i;
+        long before;
+        long long start;
+        char **chunks;
+        int t;
+
+        memset(&res, 0, sizeof(res));
+        /* dump_core_self() is chatty; keep stdout for the results */
+        t = open("/dev/null", O_WRONLY);
+        dup2(t, 1);
+        close(t);
+
+        n = size / chunk;
+        if(size > (unsigned long)-1 || !(chunks = calloc(n ? n : 1, sizeof(char*))))
+        {
+                res.error = ENOMEM;
+                goto out;
+        }
+        for(i=0;i<n;i++)
+        {
+                chunks[i] = malloc(chunk);
+                if(!chunks[i])
+                {
+                        res.error = ENOMEM;
+                        goto out;
+                }
+                touch_pages(chunks[i], chunk, touch);
+        }
+        if(free_every)
+                for(i=0;i<n;i+=free_every)
+                        free(chunks[i]);
+
+        for(t=0;t<nthread;t++)
+        {
+                worker[t].size = worker_size;
+                pthread_create(&worker[t].thread, NULL, worker_main, &worker[t]);
+        }
+
+        heap_dump_mode = m->heap_dump_mode;
+        dump_io = io;
+        dump_sync = sync_mode;
+        if(copy_threads && dump_copy_init(copy_threads) < 0)
+        {
+                res.error = errno;
+                goto out;
+        }
+        if(m->helper && dump_helper_start() < 0)
+        {
+                res.error = errno;
+                goto out;
+        }
+
+        getrusage(RUSAGE_SELF, &ru);
+        before = ru.ru_maxrss;
+        dumping = 1;
+        start = now_ns();
+        dump_core_self(core_path);
+        res.wall_ns = now_ns() - start;
+        dumping = 0;
+        res.stats = dump_stats;
+        getrusage(RUSAGE_SELF, &ru);
+        res.rss_overhead_kb = ru.ru_maxrss - before;
+        if(m->helper)
+                res.rss_overhead_kb += vm_hwm(dump_helper_pid);
+
+        stop = 1;
+        res.pause_ns = nthread ? 0 : res.wall_ns;
+        for(t=0;t<nthread;t++)
+        {
+                pthread_join(worker[t].thread, NULL);
+                if(worker[t].max_gap > res.pause_ns)
+                        res.pause_ns = worker[t].max_gap;
+        }
+        if(stat(core_path, &st) == 0)
+                res.bytes = st.st_size;
+        if(!keep_core)
+                unlink(core_path);
+out:
+        write(fd, &res, sizeof(res));
+        _exit(0);
+}
+
+char *phase_key[DUMP_PHASE_MAX] = { "discover", "notes", "open", "copy", "write", "sync", "close" };
+
+void run(BENCH_MODE *m, unsigned long long size, int rep)
+{
+        RESULT res;
+        int fd[2], pid, p;
+
+        memset(&res, 0, sizeof(res));
+        if(pipe(fd) < 0)
+        {
+                perror("pipe");
+                exit(1);
+        }
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0)
+        {
+                close(fd[0]);
+                run_child(fd[1], m, size);
+        }
+        close(fd[1]);
+        if(read(fd[0], &res, sizeof(res)) != sizeof(res))
+                res.error = ECHILD;
+        close(fd[0]);
+        waitpid(pid, NULL, 0);
+
+        printf("{\"mode\":\"%s\",\"heap\":%llu,\"threads\":%d,\"copy_threads\":%d,\"pattern\":\"%s\","
+               "\"chunk\":%lu,\"free_every\":%d,\"io\":\"%s\",\"sync\":\"%s\",\"rep\":%d", m->name,
+               size, nthread, copy_threads, patterns[touch], chunk, free_every, io_names[io],
+               sync_names[sync_mode], rep);
+        if(res.error)
+        {
+                printf(",\"error\":\"%s\"}\n", strerror(res.error));
+        }
+        else
+        {
+                printf(",\"pause_ns\":%lld,\"wall_ns\":%lld,\"bytes\":%lld,\"bytes_per_sec\":%.0f,"
+                       "\"rss_overhead_kb\":%ld", res.pause_ns, res.wall_ns, res.bytes,
+                       res.wall_ns ? res.bytes * 1e9 / res.wall_ns : 0.0, res.rss_overhead_kb);
+                for(p=0;p<DUMP_PHASE_MAX;p++)
+                        printf(",\"%s_ns\":%llu", phase_key[p], res.stats.phase[p].ns);
+                printf("}\n");
+        }
+        fflush(stdout);
+}
+
+int lookup(char **names, char *name)
+{
+        int i;
+
+        for(i=0;names[i];i++)
+                if(strcmp(names[i], name) == 0)
+                        return i;
+        return -1;
+}
+
+void usage(char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -s size[,size]  heap sizes, K/M/G suffixes (1M,16M,256M)\n"
+                "  -m mode[,mode]  maps, chunks, helper-maps, helper-chunks (all)\n"
+                "  -t threads      worker threads touching memory (0)\n"
+                "  -j threads      dump copy workers (0)\n"
+                "  -i io           cached, dropbehind, direct (dropbehind)\n"
+                "  -y sync         none, data, full (data)\n"
+                "  -w size         memory per worker (1M)\n"
+                "  -p pattern      none, seq, sparse, random (seq)\n"
+                "  -c size         allocation size used to build the heap (64K)\n"
+                "  -f n            free every n-th allocation, 0 for none (2)\n"
+                "  -r reps         repetitions per configuration (1)\n"
+                "  -o file         core file path (bench.core)\n"
+                "  -k              keep the last core file\n", prog);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        char *sizes = "1M,16M,256M", *mlist = NULL, *tok;
+        int opt, i, r, j;
+
+        while((opt = getopt(argc, argv, "s:m:t:j:i:y:w:p:c:f:r:o:k")) != -1)
+        {
+                switch(opt)
+                {
+                        case 's': sizes = optarg; break;
+                        case 'm': mlist = optarg; break;
+                        case 't': nthread = atoi(optarg); break;
+                        case 'j': copy_threads = atoi(optarg); break;
+                        case 'w': worker_size = parse_size(optarg); break;
+                        case 'c': chunk = parse_size(optarg); break;
+                        case 'f': free_every = atoi(optarg); break;
+                        case 'r': reps = atoi(optarg); break;
+                        case 'o': core_path = optarg; break;
+                        case 'k': keep_core = 1; break;
+                        case 'i':
+                                if((io = lookup(io_names, optarg)) < 0)
+                                        usage(argv[0]);
+                                break;
+                        case 'y':
+                                if((sync_mode = lookup(sync_names, optarg)) < 0)
+                                        usage(argv[0]);
+                                break;
+                        case 'p':
+                                for(touch=0;patterns[touch];touch++)
+                                        if(strcmp(patterns[touch], optarg) == 0)
+                                                break;
+                                if(!patterns[touch])
+                                        usage(argv[0]);
+                                break;
+                        default:
+                                usage(argv[0]);
+                }
+        }
+        if(nthread > MAX_WORKERS || chunk == 0 || worker_size < page_size)
+                usage(argv[0]);
+
+        sizes = strdup(sizes);
+        for(tok=strtok(sizes, ",");tok && nsize<MAX_SIZES;tok=strtok(NULL, ","))
+                heap_size[nsize++] = parse_size(tok);
+        if(mlist)
+        {
+                for(tok=strtok(mlist, ",");tok && nmode<MAX_MODES;tok=strtok(NULL, ","))
+                {
+                        for(j=0;modes[j].name;j++)
+                                if(strcmp(modes[j].name, tok) == 0)
+                                        break;
+                        if(!modes[j].name)
+                                usage(argv[0]);
+                        mode[nmode++] = &modes[j];
+                }
+        }
+        else
+        {
+                for(j=0;modes[j].name && nmode<MAX_MODES;j++)
+                        mode[nmode++] = &modes[j];
+        }
+
+        for(i=0;i<nsize;i++)
+                for(j=0;j<nmode;j++)
+                        for(r=0;r<reps;r++)
+                                run(mode[j], heap_size[i], r);
+        return 0;
+}
@@ -0,0 +1,423 @@
+/*
+ * Streaming stack exporter, see export.h.
+ *
+ * Output goes through one EXPORT_BUF buffer and write(2); nothing is
+ * built up per sample.  Folded output is one line per sample, root
+ * first, frames separated by ';' and inlined frames expanded.  pprof
+ * output is an uncompressed profile.proto Profile written field by field:
+ * a string, function or location is emitted the first time a sample
+ * needs it and its index remembered in a fixed, open addressed table.
+ * Repeated fields may interleave in the protobuf wire format, so readers
+ * reassemble the tables in order.  Once a table is 3/4 full, new entries
+ * are still emitted but no longer remembered; the profile then grows
+ * duplicates instead of the exporter growing memory.
+ *
+ * Symbolization is stack_resolve() (symbol index, with inline frames and
+ * file:line) and stack_symbol() where an object has no index.
+ *
+ *   gcc -m32 -O2 -c export.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "stack.h"
+#include "export.h"
+
+/* profile.proto field numbers */
+#define PB_PROFILE_SAMPLE_TYPE  1
+#define PB_PROFILE_SAMPLE       2
+#define PB_PROFILE_LOCATION     4
+#define PB_PROFILE_FUNCTION     5
+#define PB_PROFILE_STRING       6
+#define PB_PROFILE_TIME         9
+
+#define PB_VARINT               0
+#define PB_BYTES                2
+
+#define EXPORT_FRAMES   16
+#define EXPORT_TEXT     2048          /* One pc's folded frames              */
+
+void export_flush(EXPORT *e)
+{
+        char *p = e->buf;
+        ssize_t n;
+
+        while(e->len && !e->error)
+        {
+                n = write(e->fd, p, e->len);
+                if(n < 0 && errno == EINTR)
+                        continue;
+                if(n <= 0)
+                {
+                        e->error = n < 0 ? errno : EIO;
+                        break;
+                }
+                p += n;
+                e->len -= n;
+        }
+        e->len = 0;
+}
+
+void export_put(EXPORT *e, const void *data, unsigned long len)
+{
+        unsigned long n;
+
+        while(len)
+        {
+                if(e->len == EXPORT_BUF)
+                        export_flush(e);
+                n = EXPORT_BUF - e->len;
+                if(n > len)
+                        n = len;
+                memcpy(e->buf + e->len, data, n);
+                e->len += n;
+                data = (const char*)data + n;
+                len -= n;
+        }
+}
+
+static inline char *pb_varint(char *p, unsigned long long v)
+{
+        while(v >= 0x80)
+        {
+                *p++ = v | 0x80;
+                v >>= 7;
+        }
+        *p++ = v;
+        return p;
+}
+
+static inline char *pb_key(char *p, int field, int wire)
+{
+        return pb_varint(p, field << 3 | wire);
+}
+
+static inline char *pb_uint(char *p, int field, unsigned long long v)
+{
+        return pb_varint(pb_key(p, field, PB_VARINT), v);
+}
+
+/* Length delimited field of the Profile itself */
+void export_msg(EXPORT *e, int field, const void *data, unsigned long len)
+{
+        char hdr[16], *p = hdr;
+
+        p = pb_key(p, field, PB_BYTES);
+        p = pb_varint(p, len);
+        export_put(e, hdr, p - hdr);
+        export_put(e, data, len);
+}
+
+unsigned int export_hash(const char *s, int len)
+{
+        unsigned int h = 2166136261u;
+        int i;
+
+        for(i=0;i<len;i++)
+                h = (h ^ (unsigned char)s[i]) * 16777619u;
+        return h;
+}
+
+/* Copy to the pool, returns the offset or 0 when it is full */
+unsigned int export_keep(EXPORT *e, const char *s, int len)
+{
+        unsigned int off = e->pool_len;
+
+        if(!off)
+                off = e->pool_len = 1;          /* 0 means "not kept" */
+        if(off + len > EXPORT_POOL)
+                return 0;
+        memcpy(e->pool + off, s, len);
+        e->pool_len += len;
+        return off;
+}
+
+/* String table index of s, emitting it on first use */
+unsigned int export_string(EXPORT *e, const char *s, int len)
+{
+        unsigned int h = export_hash(s, len), i;
+        EXPORT_STR *t;
+
+        if(!len)
+                return 0;
+        for(i=h;;i++)
+        {
+                t = &e->str[i & (EXPORT_STRS-1)];
+                if(!t->off)
+                        break;
+                if(t->hash == h && t->len == (unsigned)len && !memcmp(e->pool + t->off, s, len))
+                        return t->idx;
+        }
+        export_msg(e, PB_PROFILE_STRING, s, len);
+        if(e->nstr < EXPORT_STRS / 4 * 3 && (t->off = export_keep(e, s, len)))
+        {
+                t->hash = h;
+                t->len = len;
+                t->idx = e->nstr;
+        }
+        return e->nstr++;
+}
+
+unsigned int export_function(EXPORT *e, unsigned int name, unsigned int file)
+{
+        unsigned int h = (name * 0x9e3779b1u) ^ file, i, id;
+        EXPORT_FUNC *t;
+        char msg[64], *p = msg;
+
+        for(i=h;;i++)
+        {
+                t = &e->func[i & (EXPORT_FUNCS-1)];
+                if(!t->id)
+                        break;
+                if(t->name == name && t->file == file)
+                        return t->id;
+        }
+        id = ++e->nfunc;
+        if(id < EXPORT_FUNCS / 4 * 3)
+        {
+                t->name = name;
+                t->file = file;
+                t->id = id;
+        }
+        p = pb_uint(p, 1, id);
+        p = pb_uint(p, 2, name);
+        p = pb_uint(p, 3, name);
+        p = pb_uint(p, 4, file);
+        export_msg(e, PB_PROFILE_FUNCTION, msg, p - msg);
+        return id;
+}
+
+/*
+ * Frames of addr, innermost first.  Without a symbol index this is the
+ * stack_symbol() name with its offset dropped, so it folds by function.
+ */
+int export_frames(unsigned long addr, STACK_FRAME *f, char *sym, int len)
+{
+        char *off;
+        int n;
+
+        n = stack_resolve(addr, f, EXPORT_FRAMES);
+        if(n && f[n-1].func[0])
+                return n;
+        stack_symbol(addr, sym, len);
+        off = strrchr(sym, '+');
+        if(off && strncmp(sym, "0x", 2))
+                *off = 0;
+        f[0].func = sym;
+        f[0].offset = 0;
+        f[0].file = NULL;
+        f[0].line = 0;
+        return 1;
+}
+
+/* Folded text of addr, outermost frame first, into text */
+int export_fold(unsigned long addr, char *text, int len)
+{
+        STACK_FRAME f[EXPORT_FRAMES];
+        char sym[256];
+        int n, i, got = 0;
+
+        n = export_frames(addr, f, sym, sizeof(sym));
+        for(i=n-1;i>=0 && got<len;i--)
+                got += snprintf(text + got, len - got, "%s%s", f[i].func[0] ? f[i].func : "??",
+                                i ? ";" : "");
+        return got < len ? got : len - 1;
+}
+
+/* pprof Location for addr, or for a frame named leaf when addr is 0 */
+unsigned int export_location(EXPORT *e, unsigned long addr, const char *leaf,
+                             unsigned int id)
+{
+        STACK_FRAME f[EXPORT_FRAMES];
+        char msg[EXPORT_FRAMES * 32 + 64], sym[256], *p = msg, *q;
+        char line[32];
+        int n, i;
+
+        if(leaf)
+        {
+                f[0].func = leaf;
+                f[0].file = NULL;
+                f[0].line = 0;
+                n = 1;
+        }
+        else
+                n = export_frames(addr, f, sym, sizeof(sym));
+        p = pb_uint(p, 1, id);
+        if(addr)
+                p = pb_uint(p, 3, addr);
+        for(i=0;i<n;i++)
+        {
+                unsigned int name = export_string(e, f[i].func, strlen(f[i].func));
+                unsigned int file = f[i].file ? export_string(e, f[i].file, strlen(f[i].file)) : 0;
+
+                q = line;
+                q = pb_uint(q, 1, export_function(e, name, file));
+                if(f[i].line)
+                        q = pb_uint(q, 2, f[i].line);
+                p = pb_key(p, 4, PB_BYTES);
+                p = pb_varint(p, q - line);
+                memcpy(p, line, q - line);
+                p += q - line;
+        }
+        export_msg(e, PB_PROFILE_LOCATION, msg, p - msg);
+        return id;
+}
+
+/*
+ * Remembered location of addr (or of leaf), creating it on first use.
+ * In folded mode its text is kept; a NULL return means the table or pool
+ * is full and the caller produces it on the spot.
+ */
+EXPORT_LOC *export_loc(EXPORT *e, unsigned long addr, const char *leaf, unsigned int leaf_str)
+{
+        unsigned int h = (addr ^ (addr >> 15) ^ leaf_str) * 0x9e3779b1u, i;
+        char text[EXPORT_TEXT];
+        EXPORT_LOC *t;
+        int len;
+
+        for(i=h;;i++)
+        {
+                t = &e->loc[i & (EXPORT_LOCS-1)];
+                if(!t->id)
+                        break;
+                if(t->pc == addr && t->leaf == leaf_str)
+                        return t;
+        }
+        if(e->nloc >= EXPORT_LOCS / 4 * 3)
+                return NULL;
+        if(e->format == EXPORT_FOLDED)
+        {
+                len = export_fold(addr, text, sizeof(text));
+                if(!(t->text = export_keep(e, text, len)))
+                        return NULL;
+                t->len = len;
+                t->id = ++e->nloc;
+        }
+        else
+                t->id = export_location(e, addr, leaf, ++e->nloc);
+        t->pc = addr;
+        t->leaf = leaf_str;
+        return t;
+}
+
+int export_open(EXPORT *e, int fd, int format, char **type, char **unit, int nvalue)
+{
+        char msg[32], *p;
+        struct timespec ts;
+        int i;
+
+        memset(e, 0, offsetof(EXPORT, loc));
+        memset(e->loc, 0, sizeof(e->loc));
+        memset(e->func, 0, sizeof(e->func));
+        memset(e->str, 0, sizeof(e->str));
+        e->fd = fd;
+        e->format = format;
+        e->nvalue = nvalue < EXPORT_VALUES ? nvalue : EXPORT_VALUES;
+        if(format != EXPORT_PPROF)
+                return 0;
+        /* String 0 must be "" */
+        export_msg(e, PB_PROFILE_STRING, "", 0);
+        e->nstr = 1;
+        for(i=0;i<e->nvalue;i++)
+        {
+                p = msg;
+                p = pb_uint(p, 1, export_string(e, type[i], strlen(type[i])));
+                p = pb_uint(p, 2, export_string(e, unit[i], strlen(unit[i])));
+                export_msg(e, PB_PROFILE_SAMPLE_TYPE, msg, p - msg);
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        p = pb_uint(msg, PB_PROFILE_TIME, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+        export_put(e, msg, p - msg);
+        return e->error ? -1 : 0;
+}
+
+void export_sample_folded(EXPORT *e, unsigned long *pc, int depth, int n_exact,
+                          const char *leaf, long long value)
+{
+        char text[EXPORT_TEXT], num[32];
+        EXPORT_LOC *l;
+        int i, len;
+
+        for(i=depth-1;i>=0;i--)
+        {
+                unsigned long addr = i < n_exact ? pc[i] : pc[i] - 1;
+
+                if((l = export_loc(e, addr, NULL, 0)))
+                        export_put(e, e->pool + l->text, l->len);
+                else
+                {
+                        len = export_fold(addr, text, sizeof(text));
+                        export_put(e, text, len);
+                }
+                if(i || leaf)
+                        export_put(e, ";", 1);
+        }
+        if(leaf)
+                export_put(e, leaf, strlen(leaf));
+        len = snprintf(num, sizeof(num), " %lld\n", value);
+        export_put(e, num, len);
+}
+
+void export_sample(EXPORT *e, unsigned long *pc, int depth, int n_exact,
+                   const char *leaf, long long *value)
+{
+        char msg[(STACK_MAX_DEPTH + 1 + EXPORT_VALUES) * 10 + 32], *p = msg, *n;
+        char ids[(STACK_MAX_DEPTH + 1) * 5];
+        unsigned int leaf_str = 0;
+        EXPORT_LOC *l;
+        int i;
+
+        e->samples++;
+        if(depth > STACK_MAX_DEPTH)
+                depth = STACK_MAX_DEPTH;
+        if(e->format == EXPORT_FOLDED)
+        {
+                export_sample_folded(e, pc, depth, n_exact, leaf, value[0]);
+                return;
+        }
+
+        /* location_id and value, both packed; location_id[0] is the leaf */
+        n = ids;
+        if(leaf)
+        {
+                leaf_str = export_string(e, leaf, strlen(leaf));
+                l = export_loc(e, 0, leaf, leaf_str);
+                n = pb_varint(n, l ? l->id : export_location(e, 0, leaf, ++e->nloc));
+        }
+        for(i=0;i<depth;i++)
+        {
+                unsigned long addr = i < n_exact ? pc[i] : pc[i] - 1;
+
+                l = export_loc(e, addr, NULL, 0);
+                n = pb_varint(n, l ? l->id : export_location(e, addr, NULL, ++e->nloc));
+        }
+        p = pb_key(p, 1, PB_BYTES);
+        p = pb_varint(p, n - ids);
+        memcpy(p, ids, n - ids);
+        p += n - ids;
+
+        n = ids;
+        for(i=0;i<e->nvalue;i++)
+                n = pb_varint(n, value[i]);
+        p = pb_key(p, 2, PB_BYTES);
+        p = pb_varint(p, n - ids);
+        memcpy(p, ids, n - ids);
+        p += n - ids;
+        export_msg(e, PB_PROFILE_SAMPLE, msg, p - msg);
+}
+
+int export_close(EXPORT *e)
+{
+        export_flush(e);
+        if(e->error)
+        {
+                errno = e->error;
+                return -1;
+        }
+        return 0;
+}
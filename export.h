@@ -0,0 +1,74 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+/*
+ * Streaming exporter for aggregated stacks, see export.c.  Samples are
+ * written as they are added, in folded text or pprof protobuf:
+ *
+ *      static EXPORT e;
+ *      char *type[] = { "delay", "contentions" };
+ *      char *unit[] = { "nanoseconds", "count" };
+ *
+ *      export_open(&e, fd, EXPORT_PPROF, type, unit, 2);
+ *      export_sample(&e, pc, depth, 0, "pthread_mutex_lock", value);
+ *      export_close(&e);
+ *
+ * pc is innermost first, as stack_walk() leaves it; entries past the
+ * first n_exact are return addresses.  leaf, if not NULL, is added as an
+ * extra innermost frame.  Folded output only has room for value[0].
+ * An EXPORT is a few MB and is usually static; memory use does not grow
+ * with the number of samples.
+ */
+#define EXPORT_FOLDED   0
+#define EXPORT_PPROF    1
+
+#define EXPORT_BUF      (64*1024)
+#define EXPORT_VALUES   4
+#define EXPORT_LOCS     16384         /* power of two                        */
+#define EXPORT_FUNCS    8192          /* power of two                        */
+#define EXPORT_STRS     16384         /* power of two                        */
+#define EXPORT_POOL     (1024*1024)   /* interned strings and folded frames  */
+
+typedef struct export_loc {
+        unsigned long  pc;            /* pc looked up, 0 for a leaf name     */
+        unsigned int   leaf;          /* leaf name's string index            */
+        unsigned int   id;            /* pprof location id, 0: free          */
+        unsigned int   text;          /* folded frames in the pool           */
+        unsigned int   len;
+} EXPORT_LOC;
+
+typedef struct export_func {
+        unsigned int   name;
+        unsigned int   file;
+        unsigned int   id;            /* 0: free                             */
+} EXPORT_FUNC;
+
+typedef struct export_str {
+        unsigned int   hash;
+        unsigned int   off;           /* in the pool, 0: free                */
+        unsigned int   len;
+        unsigned int   idx;           /* string table index                  */
+} EXPORT_STR;
+
+typedef struct export {
+        int            fd;
+        int            format;
+        int            nvalue;
+        int            error;
+        unsigned long  len;
+        unsigned long long samples;
+        unsigned int   nloc, nfunc, nstr;
+        unsigned int   pool_len;
+        EXPORT_LOC     loc[EXPORT_LOCS];
+        EXPORT_FUNC    func[EXPORT_FUNCS];
+        EXPORT_STR     str[EXPORT_STRS];
+        char           pool[EXPORT_POOL];
+        char           buf[EXPORT_BUF];
+} EXPORT;
+
+int  export_open(EXPORT *e, int fd, int format, char **type, char **unit, int nvalue);
+void export_sample(EXPORT *e, unsigned long *pc, int depth, int n_exact,
+                   const char *leaf, long long *value);
+int  export_close(EXPORT *e);
+
+#endif
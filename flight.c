@@ -0,0 +1,148 @@
+/*
+ * Flight recorder.
+ *
+ * Every thread owns a ring of its last FLIGHT_EVENTS events.  An event is a
+ * TSC timestamp, a caller supplied tag and a FLIGHT_DEPTH deep stack from
+ * stack_capture().  Only the owning thread writes its ring, so recording
+ * is a frame walk plus a few plain stores; head is bumped after the event
+ * is complete, so a reader trusts the last FLIGHT_EVENTS slots below head.
+ *
+ * dump_core() picks the rings up through flight_rings() and writes them,
+ * FLIGHT_HDR first, as an NT_SFRAME_FLIGHT note.  Rings are mmapped per
+ * thread and outlive it, so the history of threads that already exited
+ * stays in the core until the slot is reused.
+ *
+ *   gcc -m32 -fno-omit-frame-pointer -DSEGMENT_NO_MAIN -DSTACK_NO_MAIN \
+ *       app.c flight.c stack.c segment.c -lpthread -ldl
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "stack.h"
+#include "flight.h"
+
+FLIGHT_HDR flight_hdr;
+FLIGHT_RING *flight_ring[FLIGHT_THREADS];
+volatile int flight_nring;
+__thread FLIGHT_RING *flight_self;
+pthread_key_t flight_key;
+pthread_once_t flight_once = PTHREAD_ONCE_INIT;
+
+unsigned long long flight_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Thread exit: keep the ring for the post-mortem, allow its reuse */
+void flight_exit(void *arg)
+{
+        FLIGHT_RING *ring = (FLIGHT_RING*)arg;
+
+        ring->live = 0;
+}
+
+void flight_init(void)
+{
+        pthread_key_create(&flight_key, flight_exit);
+        flight_hdr.magic = FLIGHT_MAGIC;
+        flight_hdr.events = FLIGHT_EVENTS;
+        flight_hdr.depth = FLIGHT_DEPTH;
+        flight_hdr.ring_size = sizeof(FLIGHT_RING);
+        flight_hdr.tsc0 = __builtin_ia32_rdtsc();
+        flight_hdr.ns0 = flight_ns();
+}
+
+FLIGHT_RING *flight_attach(void)
+{
+        FLIGHT_RING *ring = NULL;
+        int i;
+
+        pthread_once(&flight_once, flight_init);
+        i = __sync_fetch_and_add(&flight_nring, 1);
+        if(i < FLIGHT_THREADS)
+        {
+                ring = mmap(NULL, sizeof(FLIGHT_RING), PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                if(ring == MAP_FAILED)
+                        return NULL;
+                flight_ring[i] = ring;
+        }
+        else
+        {
+                /* Table full: take over the ring of a thread that exited */
+                __sync_fetch_and_sub(&flight_nring, 1);
+                for(i=0;i<FLIGHT_THREADS && !ring;i++)
+                        if(flight_ring[i] && !flight_ring[i]->live &&
+                           __sync_bool_compare_and_swap(&flight_ring[i]->live, 0, 1))
+                                ring = flight_ring[i];
+                if(!ring)
+                        return NULL;
+                ring->head = 0;
+        }
+        ring->tid = syscall(SYS_gettid);
+        prctl(PR_GET_NAME, ring->name, 0L, 0L, 0L);
+        ring->live = 1;
+        pthread_setspecific(flight_key, ring);
+        return ring;
+}
+
+void flight_record(unsigned long tag)
+{
+        FLIGHT_RING *ring = flight_self;
+        FLIGHT_EVENT *e;
+        unsigned long head;
+
+        if(!ring)
+        {
+                ring = flight_self = flight_attach();
+                if(!ring)
+                        return;
+        }
+        head = ring->head;
+        e = &ring->event[head & (FLIGHT_EVENTS-1)];
+        e->tsc = __builtin_ia32_rdtsc();
+        e->tag = tag;
+        e->depth = stack_capture(e->pc, FLIGHT_DEPTH);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Memory making up the NT_SFRAME_FLIGHT note: flight_hdr, then every ring.
+ * Also stamps the TSC/clock pair a reader needs to turn event TSCs into
+ * time.  The iovecs point into this process, which is what the dump
+ * helper reads from as well.
+ */
+int flight_rings(struct iovec *iov, int max)
+{
+        int i, n = 0, nring = flight_nring;
+
+        if(nring > FLIGHT_THREADS)
+                nring = FLIGHT_THREADS;
+        if(!nring || max < 2)
+                return 0;
+        flight_hdr.tsc1 = __builtin_ia32_rdtsc();
+        flight_hdr.ns1 = flight_ns();
+        iov[n].iov_base = &flight_hdr;
+        iov[n].iov_len = sizeof(FLIGHT_HDR);
+        n++;
+        for(i=0;i<nring && n<max;i++)
+        {
+                if(!flight_ring[i])
+                        continue;
+                iov[n].iov_base = flight_ring[i];
+                iov[n].iov_len = sizeof(FLIGHT_RING);
+                n++;
+        }
+        flight_hdr.nring = n - 1;
+        return n;
+}
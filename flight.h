@@ -0,0 +1,49 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <sys/uio.h>
+
+/*
+ * Per-thread flight recorder, written into cores as an NT_SFRAME_FLIGHT
+ * note: one FLIGHT_HDR followed by FLIGHT_RINGs of ring_size bytes, nring
+ * of them unless the note was cut short (see n_descsz).
+ * Event slot i of a ring is valid for head-FLIGHT_EVENTS <= i < head.
+ */
+#define FLIGHT_MAGIC   0x54474c46 /* "FLGT" */
+#define FLIGHT_EVENTS  256        /* power of two */
+#define FLIGHT_DEPTH   6
+#define FLIGHT_THREADS 256
+
+typedef struct
+{
+        unsigned long magic;
+        unsigned long events;
+        unsigned long depth;
+        unsigned long ring_size;
+        unsigned long nring;
+        /* tsc0/ns0 at first use, tsc1/ns1 at dump: tsc to time calibration */
+        unsigned long long tsc0, ns0;
+        unsigned long long tsc1, ns1;
+}FLIGHT_HDR;
+
+typedef struct
+{
+        unsigned long long tsc;
+        unsigned long tag;
+        unsigned long depth;
+        unsigned long pc[FLIGHT_DEPTH];
+}FLIGHT_EVENT;
+
+typedef struct
+{
+        int tid;
+        volatile int live;
+        char name[16];
+        volatile unsigned long head;
+        FLIGHT_EVENT event[FLIGHT_EVENTS];
+}FLIGHT_RING;
+
+void flight_record(unsigned long tag);
+int flight_rings(struct iovec *iov, int max);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Latency outlier tracing, see latency.h.
+ *
+ * latency_end() costs an rdtsc, a TSC to ns multiply and two relaxed
+ * counter updates.  Only an outlier walks the EBP chain (stack_walk()
+ * from stack.c, starting at the timed function) and takes latency_lock
+ * to intern the stack in an open addressed table keyed by site and pcs.
+ *
+ *   gcc -m32 -g -rdynamic -fno-omit-frame-pointer -DSTACK_NO_MAIN \
+ *       app.c latency.c export.c stack.c -o app -lpthread -ldl
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stack.h"
+#include "latency.h"
+#include "export.h"
+
+typedef struct {
+        LATENCY_SITE  *site;          /* NULL: free entry                    */
+        unsigned long  hash;
+        int            depth;
+        unsigned long  pc[LATENCY_DEPTH];
+        unsigned long  count;
+        unsigned long long total_ns;
+        unsigned long long max_ns;
+        unsigned long  hist[LATENCY_BUCKETS];
+} LATENCY_STACK;
+
+LATENCY_SITE *latency_sites;
+LATENCY_STACK latency_stack[LATENCY_STACKS];
+int latency_nstack;
+unsigned long latency_dropped;        /* Outliers that found the table full */
+pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ns = tsc * latency_mult >> 16 once calibrated, ns = tsc before */
+unsigned long long latency_mult;
+
+unsigned long long latency_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Calibrate the TSC against CLOCK_MONOTONIC over 10ms */
+void latency_init(void)
+{
+        struct timespec ts = { 0, 10000000 };
+        unsigned long long tsc0, ns0, tsc1, ns1;
+
+        tsc0 = __builtin_ia32_rdtsc();
+        ns0 = latency_ns();
+        nanosleep(&ts, NULL);
+        tsc1 = __builtin_ia32_rdtsc();
+        ns1 = latency_ns();
+        latency_mult = ((ns1 - ns0) << 16) / (tsc1 - tsc0);
+}
+
+static inline unsigned long long latency_tsc_ns(unsigned long long tsc)
+{
+        return latency_mult ? (tsc * latency_mult) >> 16 : tsc;
+}
+
+static inline int latency_bucket(unsigned long long ns)
+{
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+        return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+void latency_register(LATENCY_SITE *site)
+{
+        LATENCY_SITE *head;
+
+        if(!__sync_bool_compare_and_swap(&site->registered, 0, 1))
+                return;
+        do
+        {
+                head = latency_sites;
+                site->next = head;
+        }while(!__sync_bool_compare_and_swap(&latency_sites, head, site));
+}
+
+void latency_intern(LATENCY_SITE *site, unsigned long *pc, int depth,
+                    unsigned long long ns)
+{
+        LATENCY_STACK *s;
+        unsigned long hash = (unsigned long)site, slot;
+        int i;
+
+        for(i=0;i<depth;i++)
+                hash = (hash ^ pc[i]) * 0x01000193;
+        pthread_mutex_lock(&latency_lock);
+        for(slot=hash;;slot++)
+        {
+                s = &latency_stack[slot & (LATENCY_STACKS-1)];
+                if(!s->site)
+                {
+                        /* Keep one entry free so the probe always ends */
+                        if(latency_nstack == LATENCY_STACKS - 1)
+                        {
+                                latency_dropped++;
+                                pthread_mutex_unlock(&latency_lock);
+                                return;
+                        }
+                        latency_nstack++;
+                        s->site = site;
+                        s->hash = hash;
+                        s->depth = depth;
+                        memcpy(s->pc, pc, depth * sizeof(unsigned long));
+                        break;
+                }
+                if(s->site == site && s->hash == hash && s->depth == depth &&
+                   !memcmp(s->pc, pc, depth * sizeof(unsigned long)))
+                        break;
+        }
+        s->count++;
+        s->total_ns += ns;
+        if(ns > s->max_ns)
+                s->max_ns = ns;
+        s->hist[latency_bucket(ns)]++;
+        pthread_mutex_unlock(&latency_lock);
+}
+
+__attribute__((noinline))
+void latency_end(LATENCY_TIMER *t)
+{
+        LATENCY_SITE *site = t->site;
+        unsigned long long tsc = __builtin_ia32_rdtsc() - t->tsc;
+        unsigned long long ns = latency_tsc_ns(tsc);
+        unsigned long pc[LATENCY_DEPTH];
+        int depth;
+
+        if(!site->registered)
+                latency_register(site);
+        __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->hist[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+        if(!site->threshold_tsc)
+        {
+                if(!latency_mult)
+                        return;
+                site->threshold_tsc = (site->threshold_ns << 16) / latency_mult;
+        }
+        if(tsc < site->threshold_tsc)
+                return;
+
+        __atomic_fetch_add(&site->outliers, 1, __ATOMIC_RELAXED);
+        /* pc[0] is the return into the timed function */
+        depth = stack_walk((unsigned long *)__builtin_frame_address(0), pc, LATENCY_DEPTH);
+        latency_intern(site, pc, depth, ns);
+}
+
+void latency_hist(int fd, unsigned long *hist)
+{
+        unsigned long max = 0;
+        int b, lo = LATENCY_BUCKETS, hi = 0;
+        char bar[41];
+
+        for(b=0;b<LATENCY_BUCKETS;b++)
+                if(hist[b])
+                {
+                        if(b < lo)
+                                lo = b;
+                        hi = b;
+                        if(hist[b] > max)
+                                max = hist[b];
+                }
+        for(b=lo;b<=hi;b++)
+        {
+                int n = (unsigned long long)hist[b] * 40 / max;
+
+                if(!hist[b])
+                        continue;
+                memset(bar, '#', n);
+                bar[n] = 0;
+                dprintf(fd, "    %12llu ns %10lu %s\n", 1ULL << b, hist[b], bar);
+        }
+}
+
+int latency_cmp(const void *a, const void *b)
+{
+        const LATENCY_STACK *x = *(LATENCY_STACK **)a, *y = *(LATENCY_STACK **)b;
+
+        return x->total_ns < y->total_ns ? 1 : x->total_ns > y->total_ns ? -1 : 0;
+}
+
+/* Per site: call histogram, then each outlier stack, worst total first */
+void latency_report(int fd)
+{
+        static LATENCY_STACK *order[LATENCY_STACKS];
+        LATENCY_SITE *site;
+        LATENCY_STACK *s;
+        int i, n;
+
+        pthread_mutex_lock(&latency_lock);
+        for(site=latency_sites;site;site=site->next)
+        {
+                dprintf(fd, "latency: %s calls %lu outliers %lu threshold %llu ns\n",
+                        site->name, site->calls, site->outliers, site->threshold_ns);
+                latency_hist(fd, site->hist);
+                n = 0;
+                for(i=0;i<LATENCY_STACKS;i++)
+                        if(latency_stack[i].site == site)
+                                order[n++] = &latency_stack[i];
+                qsort(order, n, sizeof(order[0]), latency_cmp);
+                for(i=0;i<n;i++)
+                {
+                        s = order[i];
+                        dprintf(fd, "  outliers %lu total %llu ns max %llu ns\n",
+                                s->count, s->total_ns, s->max_ns);
+                        stack_print(fd, s->pc, s->depth, 0);
+                        latency_hist(fd, s->hist);
+                }
+        }
+        if(latency_dropped)
+                dprintf(fd, "latency: %lu outliers dropped, stack table full\n",
+                        latency_dropped);
+        pthread_mutex_unlock(&latency_lock);
+}
+
+/*
+ * Outlier stacks as a profile (EXPORT_FOLDED or EXPORT_PPROF), the site
+ * name as leaf: the summed duration of the outlier calls (not just the
+ * part past the threshold), then the outlier count.
+ */
+void latency_export(int fd, int format)
+{
+        static EXPORT e;
+        static char *type[] = { "outlier_time", "outliers" };
+        static char *unit[] = { "nanoseconds", "count" };
+        LATENCY_STACK *s;
+        long long value[2];
+        int i;
+
+        export_open(&e, fd, format, type, unit, 2);
+        pthread_mutex_lock(&latency_lock);
+        for(i=0;i<LATENCY_STACKS;i++)
+        {
+                s = &latency_stack[i];
+                if(!s->site)
+                        continue;
+                value[0] = s->total_ns;
+                value[1] = s->count;
+                export_sample(&e, s->pc, s->depth, 0, s->site->name, value);
+        }
+        pthread_mutex_unlock(&latency_lock);
+        if(export_close(&e) < 0)
+                perror("latency: could not write the profile");
+}
@@ -0,0 +1,64 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/*
+ * Latency outlier tracing.  A site is a static LATENCY_SITE with a name and
+ * a threshold.  Every timed call lands in the site's log2 histogram; only
+ * calls slower than the threshold walk the stack, which is interned so
+ * outliers add up per distinct stack.
+ *
+ *      LATENCY_SITE(lookup_site, "lookup", 200000);
+ *
+ *      void lookup(...)
+ *      {
+ *              LATENCY_SCOPE(&lookup_site);
+ *              ...
+ *      }
+ *
+ * or latency_begin()/latency_end() around a block.  Call latency_init()
+ * once at startup to calibrate the TSC, and latency_report() to print or
+ * latency_export() to write the outlier stacks as a folded or pprof
+ * profile (export.h).
+ */
+#define LATENCY_BUCKETS 40            /* bucket b: [2^b, 2^(b+1)) ns         */
+#define LATENCY_DEPTH   16
+#define LATENCY_STACKS  4096          /* interned outlier stacks, power of 2 */
+
+typedef struct latency_site {
+        const char    *name;
+        unsigned long long threshold_ns;
+        unsigned long long threshold_tsc; /* 0 until latency_init()          */
+        volatile int   registered;
+        struct latency_site *next;
+        unsigned long  calls;
+        unsigned long  outliers;
+        unsigned long  hist[LATENCY_BUCKETS];
+} LATENCY_SITE;
+
+typedef struct {
+        LATENCY_SITE  *site;
+        unsigned long long tsc;
+} LATENCY_TIMER;
+
+#define LATENCY_SITE(var, name, threshold_ns) \
+        static LATENCY_SITE var = { name, threshold_ns }
+
+#define LATENCY_SCOPE(site) \
+        LATENCY_TIMER latency_timer_ __attribute__((cleanup(latency_end))) = \
+                latency_begin(site)
+
+static inline LATENCY_TIMER latency_begin(LATENCY_SITE *site)
+{
+        LATENCY_TIMER t;
+
+        t.site = site;
+        t.tsc = __builtin_ia32_rdtsc();
+        return t;
+}
+
+void latency_init(void);
+void latency_end(LATENCY_TIMER *t);
+void latency_report(int fd);
+void latency_export(int fd, int format);
+
+#endif
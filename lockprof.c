@@ -0,0 +1,251 @@
+/*
+ * Lock contention profiler.
+ *
+ * Preloaded into a program, this wraps pthread_mutex_lock(), the rwlock
+ * lock calls and pthread_cond_wait().  Lock calls try the uncontended
+ * path first (the matching trylock); only when it reports EBUSY is the
+ * waiter's stack walked and the blocking call timed.  Any other trylock
+ * result, such as EOWNERDEAD from a robust mutex that was acquired, is
+ * returned as is.  Wait time adds up per distinct stack and is written
+ * at exit in folded format, root first:
+ *
+ *      main;worker;update_table;pthread_mutex_lock 123456789
+ *
+ * which flamegraph.pl takes as is.  Values are nanoseconds waited.
+ * Condition waits are recorded under their own leaf, as their wait is
+ * mostly idle time, not contention.  With LOCKPROF_FORMAT=pprof the
+ * profile is a pprof protobuf instead, with delay and contention count
+ * per stack.
+ *
+ *   gcc -m32 -g -shared -fPIC -fno-omit-frame-pointer -DSTACK_NO_MAIN \
+ *       lockprof.c export.c stack.c -o liblockprof.so -ldl -lpthread
+ *   LOCKPROF_OUT=locks.folded LD_PRELOAD=./liblockprof.so ./app
+ *
+ * The application needs -fno-omit-frame-pointer, and -rdynamic or a
+ * symbol index (symidx.h) for useful stacks.  Code built without frame
+ * pointers, libc included, leaves data in EBP; stack_walk() stops at the
+ * first frame that is not on the thread's stack, so such a program gets
+ * short stacks rather than a walk through stray pointers.  Without
+ * LOCKPROF_OUT the profile goes to stderr.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include "stack.h"
+#include "export.h"
+
+#define LOCK_DEPTH      24
+#define LOCK_STACKS     4096          /* power of two                        */
+
+#define LOCK_MUTEX      0
+#define LOCK_RDLOCK     1
+#define LOCK_WRLOCK     2
+#define LOCK_COND       3
+#define LOCK_KINDS      4
+
+char *lock_name[LOCK_KINDS] = {
+        "pthread_mutex_lock", "pthread_rwlock_rdlock",
+        "pthread_rwlock_wrlock", "pthread_cond_wait"
+};
+
+typedef struct {
+        int            used;
+        int            kind;
+        unsigned long  hash;
+        int            depth;
+        unsigned long  pc[LOCK_DEPTH];
+        unsigned long  count;
+        unsigned long long wait_ns;
+} LOCK_STACK;
+
+LOCK_STACK lock_stack[LOCK_STACKS];
+int lock_nstack;
+unsigned long lock_dropped;
+/* Our own table lock can not be a pthread mutex: we would profile it */
+volatile int lock_table;
+
+int (*real_mutex_lock)(pthread_mutex_t *);
+int (*real_mutex_trylock)(pthread_mutex_t *);
+int (*real_rdlock)(pthread_rwlock_t *);
+int (*real_tryrdlock)(pthread_rwlock_t *);
+int (*real_wrlock)(pthread_rwlock_t *);
+int (*real_trywrlock)(pthread_rwlock_t *);
+int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+
+unsigned long long lock_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__attribute__((constructor))
+void lock_init(void)
+{
+        if(real_mutex_lock)
+                return;
+        real_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+        real_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+        real_rdlock = dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+        real_tryrdlock = dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
+        real_wrlock = dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+        real_trywrlock = dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
+        /* Unversioned lookup would get the pre-NPTL condvar ABI */
+        real_cond_wait = dlvsym(RTLD_NEXT, "pthread_cond_wait", "GLIBC_2.3.2");
+        if(!real_cond_wait)
+                real_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+        /* The main thread's stack bounds come from /proc, not under a lock */
+        stack_bounds();
+}
+
+void lock_record(int kind, unsigned long *pc, int depth, unsigned long long ns)
+{
+        LOCK_STACK *s;
+        unsigned long hash = kind, slot;
+        int i;
+
+        for(i=0;i<depth;i++)
+                hash = (hash ^ pc[i]) * 0x01000193;
+        while(__sync_lock_test_and_set(&lock_table, 1))
+                while(lock_table)
+                        ;
+        for(slot=hash;;slot++)
+        {
+                s = &lock_stack[slot & (LOCK_STACKS-1)];
+                if(!s->used)
+                {
+                        if(lock_nstack == LOCK_STACKS - 1)
+                        {
+                                lock_dropped++;
+                                __sync_lock_release(&lock_table);
+                                return;
+                        }
+                        lock_nstack++;
+                        s->used = 1;
+                        s->kind = kind;
+                        s->hash = hash;
+                        s->depth = depth;
+                        memcpy(s->pc, pc, depth * sizeof(unsigned long));
+                        break;
+                }
+                if(s->kind == kind && s->hash == hash && s->depth == depth &&
+                   !memcmp(s->pc, pc, depth * sizeof(unsigned long)))
+                        break;
+        }
+        s->count++;
+        s->wait_ns += ns;
+        __sync_lock_release(&lock_table);
+}
+
+/* Walk from the wrapper, so pc[0] is the return into the lock's caller */
+#define LOCK_BLOCKED(kind, call)                                            \
+        do {                                                                \
+                unsigned long pc[LOCK_DEPTH];                               \
+                unsigned long long t0;                                      \
+                int depth = stack_walk((unsigned long *)                    \
+                                __builtin_frame_address(0), pc, LOCK_DEPTH);\
+                t0 = lock_ns();                                             \
+                ret = call;                                                 \
+                lock_record(kind, pc, depth, lock_ns() - t0);               \
+        } while(0)
+
+int pthread_mutex_lock(pthread_mutex_t *m)
+{
+        int ret;
+
+        if(!real_mutex_lock)
+                lock_init();
+        ret = real_mutex_trylock(m);
+        if(ret != EBUSY)
+                return ret;
+        LOCK_BLOCKED(LOCK_MUTEX, real_mutex_lock(m));
+        return ret;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *l)
+{
+        int ret;
+
+        if(!real_rdlock)
+                lock_init();
+        ret = real_tryrdlock(l);
+        if(ret != EBUSY)
+                return ret;
+        LOCK_BLOCKED(LOCK_RDLOCK, real_rdlock(l));
+        return ret;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *l)
+{
+        int ret;
+
+        if(!real_wrlock)
+                lock_init();
+        ret = real_trywrlock(l);
+        if(ret != EBUSY)
+                return ret;
+        LOCK_BLOCKED(LOCK_WRLOCK, real_wrlock(l));
+        return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+        int ret;
+
+        if(!real_cond_wait)
+                lock_init();
+        LOCK_BLOCKED(LOCK_COND, real_cond_wait(c, m));
+        return ret;
+}
+
+/* One sample per stack, lock call as leaf: wait time, then wait count */
+void lock_report(int fd, int format)
+{
+        static EXPORT e;
+        static char *type[] = { "delay", "contentions" };
+        static char *unit[] = { "nanoseconds", "count" };
+        LOCK_STACK *s;
+        long long value[2];
+        int i;
+
+        export_open(&e, fd, format, type, unit, 2);
+        for(i=0;i<LOCK_STACKS;i++)
+        {
+                s = &lock_stack[i];
+                if(!s->used)
+                        continue;
+                value[0] = s->wait_ns;
+                value[1] = s->count;
+                export_sample(&e, s->pc, s->depth, 0, lock_name[s->kind], value);
+        }
+        if(export_close(&e) < 0)
+                perror("lockprof: could not write the profile");
+        if(lock_dropped)
+                fprintf(stderr, "lockprof: %lu waits dropped, stack table full\n",
+                        lock_dropped);
+}
+
+__attribute__((destructor))
+void lock_fini(void)
+{
+        char *out = getenv("LOCKPROF_OUT");
+        char *format = getenv("LOCKPROF_FORMAT");
+        int fd = 2;
+
+        if(out && (fd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+        {
+                perror("lockprof: could not open LOCKPROF_OUT");
+                return;
+        }
+        lock_report(fd, format && !strcmp(format, "pprof") ? EXPORT_PPROF : EXPORT_FOLDED);
+        if(fd != 2)
+                close(fd);
+}
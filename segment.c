@@ -1,10 +1,70 @@
-#include <linux/elf.h>
+#define _GNU_SOURCE
+#include <elf.h>
 #include <sys/prctl.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <immintrin.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <cpuid.h>
+#include <link.h>
+#include <dirent.h>
+#include "segment.h"
+#include "flight.h"
 
-#define PAGE_SIZE 4096
 #define ALIGN(x,a) (((x)+(a)-1)&~((a)-1))
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE     23
+#endif
+
+/*
+ * Page sizes, read once at load time.  huge_page_size is the THP (PMD)
+ * size, the granularity huge page backed mappings are handled at.
+ */
+unsigned long page_size = 4096;
+unsigned long huge_page_size = 2*1024*1024;
+
+__attribute__((constructor))
+void page_init(void)
+{
+        char buf[32];
+        long n;
+        int fd;
+
+        n = sysconf(_SC_PAGESIZE);
+        if(n > 0)
+                page_size = n;
+        fd = open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", O_RDONLY);
+        if(fd >= 0)
+        {
+                n = read(fd, buf, sizeof(buf)-1);
+                if(n > 0)
+                {
+                        buf[n] = 0;
+                        n = atol(buf);
+                        if(n > (long)page_size && !(n & (n-1)))
+                                huge_page_size = n;
+                }
+                close(fd);
+        }
+}
+
+#ifndef EI_NIDENT
 #define EI_NIDENT       16
+#endif
 #define NT_PRSTATUS     1
 #define NT_PRFPREG      2
 #define NT_PRPSINFO     3
@@ -13,7 +73,7 @@
 #define NT_PRXFPREG     0x46e62b7f      /* copied from gdb5.1/include/elf/common.h */
 #define CORE_STR "CORE"
 #define ELF_CORE_EFLAGS 0
-#define MAX_THREAD 5
+#define MAX_THREAD 64
 
 
 /*#define int int*/
@@ -112,6 +172,22 @@ typedef struct _user {           /* Ptrace returns this data for thread state */
 
 typedef int TASKSTRUCT;
 
+#define FSAVE_SIZE      108             /* user_i387_struct: fnsave image    */
+#define FXSAVE_SIZE     512             /* user_fxsr_struct: fxsave image    */
+#define XSTATE_MAX      4096            /* Largest xsave image we keep       */
+#define XSTATE_XCR0     464             /* sw_reserved slot readers take XCR0 from */
+
+typedef struct thread_slot {    /* Registers a crashing thread left for the dump */
+        volatile int   valid;         /* Set once regs and tid are written         */
+        int            tid;           /* Kernel thread ID                          */
+        REGS           regs;          /* CPU registers at dump_core_self()         */
+        siginfo_t      info;          /* Signal being dumped for                   */
+        int            xstate_size;   /* 0: no xsave image                         */
+        unsigned char  fsave[FSAVE_SIZE];
+        unsigned char  fxsave[FXSAVE_SIZE] __attribute__((aligned(16)));
+        unsigned char  xstate[XSTATE_MAX] __attribute__((aligned(64)));
+} THREAD_SLOT;
+
 
 
 
@@ -198,201 +274,869 @@ typedef struct
 #define ELF_ARCH  EM_386
 
 
-typedef enum
-{
-        REGION_CODE,
-        REGION_DATA,
-        REGION_BSS,
-        REGION_STACK,
-        REGION_HEAP,
-        REGION_MAX
-}REGION_TYPE;
-
 typedef struct mem_region
 {
         REGION_TYPE type;
         int valid;
-        int start;
-        int end;
-        int size;
+        unsigned long start;
+        unsigned long end;
+        unsigned long size;
 }REGION;
 
+#define MAX_REGION      4096
+#define REGION_RESERVE  16              /* kept free for non-heap regions    */
+
+#define HEAP_SKIP_MIN    page_size
+
+#define NT_SFRAME_ARENA 0x100           /* owner "SFRAME": ARENA[]           */
+#define NT_SFRAME_FLIGHT 0x101          /* owner "SFRAME": see flight.h      */
+#define NT_SFRAME_BUILD_ID 0x102        /* owner "SFRAME": OBJ_ID records    */
+#define SFRAME_STR      "SFRAME"
+
+typedef struct arena_desc {     /* One heap segment of a malloc arena        */
+        unsigned long  arena;         /* struct malloc_state address         */
+        unsigned long  heap_start;    /* First byte of the heap segment      */
+        unsigned long  heap_end;      /* End of the heap segment             */
+        unsigned long  top;           /* Top chunk, 0 if not in this segment */
+        unsigned long  inuse;         /* Bytes in allocated chunks           */
+        unsigned long  free;          /* Bytes in free chunks and top        */
+} ARENA;
 
+#define MAX_ARENA       64
 
+ARENA arena[MAX_ARENA];
+int narena;
+int heap_dump_mode = HEAP_DUMP_MAPS;
 
-void dump_core(int handle, char *mem, REGS regs, REGION *r)
+/*
+ * Flight recorder rings to embed, as returned by flight_rings().  The
+ * function is weak so programs that do not link flight.c dump without it.
+ */
+#define FLIGHT_IOV      (FLIGHT_THREADS + 1)
+
+int flight_rings(struct iovec *iov, int max) __attribute__((weak));
+
+struct iovec flight_iov[FLIGHT_IOV];
+int flight_niov;
+
+
+
+
+/*
+ * Memory capture hook used by dump_core().  local[i] receives remote[i].
+ * The default copies from our own address space; the dump helper swaps in
+ * a process_vm_readv() reader for the frozen target.
+ */
+#define CAPTURE_IOV     256
+
+typedef int (*CAPTURE_FN)(struct iovec *local, struct iovec *remote, int n);
+
+/*
+ * Streaming copy.  Region data is written once and not read back by the
+ * dumper, so large copies use non-temporal stores to keep the LLC of the
+ * still running process intact.  The AVX2 or SSE2 variant is picked once
+ * from CPUID; memcpy() handles the unaligned head, the tail and small
+ * copies.
+ */
+#define NT_COPY_MIN     (64*1024)
+
+typedef void (*COPY_FN)(char *dst, const char *src, unsigned long len);
+
+void copy_plain(char *dst, const char *src, unsigned long len)
+{
+        memcpy(dst, src, len);
+}
+
+__attribute__((target("sse2")))
+void copy_nt_sse2(char *dst, const char *src, unsigned long len)
 {
+        unsigned long head = (16 - ((unsigned long)dst & 15)) & 15;
 
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        len -= head;
+        for(;len >= 64;len -= 64, dst += 64, src += 64)
+        {
+                __m128i a = _mm_loadu_si128((const __m128i*)src);
+                __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+                __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+                __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+                _mm_stream_si128((__m128i*)dst, a);
+                _mm_stream_si128((__m128i*)(dst + 16), b);
+                _mm_stream_si128((__m128i*)(dst + 32), c);
+                _mm_stream_si128((__m128i*)(dst + 48), d);
+        }
+        _mm_sfence();
+        memcpy(dst, src, len);
+}
 
+__attribute__((target("avx2")))
+void copy_nt_avx2(char *dst, const char *src, unsigned long len)
+{
+        unsigned long head = (32 - ((unsigned long)dst & 31)) & 31;
 
-        Ehdr *ehdr = (Ehdr *)mem;
-        char *name=NULL;
-        Nhdr *nhdr = NULL;
-        int nsize = 0;
-        PRSTATUS *prstatus = NULL;
-        int thread=0;
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        len -= head;
+        for(;len >= 128;len -= 128, dst += 128, src += 128)
+        {
+                __m256i a = _mm256_loadu_si256((const __m256i*)src);
+                __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+                __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+                __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+                _mm256_stream_si256((__m256i*)dst, a);
+                _mm256_stream_si256((__m256i*)(dst + 32), b);
+                _mm256_stream_si256((__m256i*)(dst + 64), c);
+                _mm256_stream_si256((__m256i*)(dst + 96), d);
+        }
+        _mm_sfence();
+        memcpy(dst, src, len);
+}
+
+COPY_FN copy_nt;
+
+COPY_FN copy_select(void)
+{
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+                return copy_nt_avx2;
+        if(__builtin_cpu_supports("sse2"))
+                return copy_nt_sse2;
+        return copy_plain;
+}
 
+void copy_region(char *dst, const char *src, unsigned long len)
+{
+        if(len < NT_COPY_MIN)
+        {
+                memcpy(dst, src, len);
+                return;
+        }
+        if(!copy_nt)
+                copy_nt = copy_select();
+        copy_nt(dst, src, len);
+}
 
+/*
+ * Copy worker pool.  dump_copy_init() starts the workers ahead of time;
+ * a capture batch of at least COPY_PARALLEL_MIN bytes is cut into
+ * COPY_SPLIT sized pieces that the workers and the dumping thread claim
+ * with an atomic counter.  Piece k is located through the per-iovec
+ * prefix counts in piece_end[], so nothing is allocated per dump.
+ *
+ * The claim and done counters carry the batch's generation in their top
+ * 32 bits and only move with a compare-and-swap against it, so a worker
+ * still looping over the previous batch can neither claim a piece of the
+ * next one nor count it done.  They are 64 bits on i386 too (cmpxchg8b),
+ * so the generation wraps after 2^32 batches, not 65536, and no worker
+ * lags that far behind.  A batch is closed (count COPY_COUNT_MASK) while
+ * its job fields are rewritten.
+ */
+#define MAX_COPY_WORKERS  32
+#define COPY_SPLIT        (1024*1024)
+#define COPY_PARALLEL_MIN (2*1024*1024)
+#define COPY_GEN_SHIFT    32
+#define COPY_COUNT_MASK   ((1ULL << COPY_GEN_SHIFT) - 1)
+
+typedef struct copy_job {
+        struct iovec *local;
+        struct iovec *remote;
+        int n;
+        unsigned long piece_end[CAPTURE_IOV];
+        unsigned long npiece;
+        volatile unsigned long long claim;  /* generation, next piece        */
+        volatile unsigned long long done;   /* generation, pieces copied     */
+} COPY_JOB;
+
+COPY_JOB copy_job;
+pthread_t copy_thread[MAX_COPY_WORKERS];
+pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+int copy_workers;
+unsigned long copy_gen;
+
+void copy_pieces(COPY_JOB *j)
+{
+        unsigned long long c, d, k, gen;
+        unsigned long off, len;
+        int i;
 
+        for(;;)
+        {
+                /* A plain 64-bit load may tear on i386 */
+                c = __atomic_load_n(&j->claim, __ATOMIC_ACQUIRE);
+                k = c & COPY_COUNT_MASK;
+                if(k >= j->npiece)
+                        break;
+                /* Fails if the batch changed since c was read */
+                if(!__sync_bool_compare_and_swap(&j->claim, c, c + 1))
+                        continue;
+                gen = c >> COPY_GEN_SHIFT;
+                for(i=0;k >= j->piece_end[i];i++)
+                        ;
+                off = (k - (i ? j->piece_end[i-1] : 0)) * COPY_SPLIT;
+                len = j->local[i].iov_len - off;
+                if(len > COPY_SPLIT)
+                        len = COPY_SPLIT;
+                copy_region((char*)j->local[i].iov_base + off,
+                            (char*)j->remote[i].iov_base + off, len);
+                do
+                        d = __atomic_load_n(&j->done, __ATOMIC_RELAXED);
+                while(d >> COPY_GEN_SHIFT == gen && !__sync_bool_compare_and_swap(&j->done, d, d + 1));
+        }
+}
 
+void *copy_worker(void *arg)
+{
+        unsigned long gen = 0;
 
-        int noffset =  sizeof(Ehdr);
-        /* Write note section                                                */
-        /* scope */
+        for(;;)
+        {
+                pthread_mutex_lock(&copy_lock);
+                while(copy_gen == gen)
+                        pthread_cond_wait(&copy_cond, &copy_lock);
+                gen = copy_gen;
+                pthread_mutex_unlock(&copy_lock);
+                copy_pieces(&copy_job);
+        }
+        return NULL;
+}
 
+int dump_copy_init(int nworkers)
+{
+        if(nworkers > MAX_COPY_WORKERS)
+                nworkers = MAX_COPY_WORKERS;
+        if(!copy_nt)
+                copy_nt = copy_select();
+        for(;copy_workers<nworkers;copy_workers++)
+                if(pthread_create(&copy_thread[copy_workers], NULL, copy_worker, NULL))
+                        return -1;
+        return 0;
+}
 
-        for(thread=0;thread<MAX_THREAD;thread++)
+int capture_self(struct iovec *local, struct iovec *remote, int n)
+{
+        COPY_JOB *j = &copy_job;
+        unsigned long long gen;
+        unsigned long total = 0;
+        int i;
+
+        for(i=0;i<n;i++)
+                total += local[i].iov_len;
+        if(!copy_workers || total < COPY_PARALLEL_MIN ||
+           total / COPY_SPLIT >= COPY_COUNT_MASK - n)
         {
-                //THREAD 1
-                nhdr = (Nhdr*)&mem[noffset + nsize];
-                memset((void*)nhdr, 0, sizeof(Nhdr));
-                nhdr->n_namesz   = 5;
-                nhdr->n_descsz   = sizeof(PRSTATUS);
-                nhdr->n_type     = NT_PRSTATUS;
-                name = (char*)&nhdr[1];
-                strncpy(name, "CORE", 4);
-                prstatus=(PRSTATUS*)(name + ALIGN(nhdr->n_namesz, 4) );
-                prstatus->pr_reg = regs;
-                prstatus->pr_cursig = 6;
-                prstatus->pr_pid = getpid()+thread;
-                nsize += sizeof(Nhdr) + ALIGN(nhdr->n_namesz, 4) + nhdr->n_descsz;
+                for(i=0;i<n;i++)
+                        copy_region(local[i].iov_base, remote[i].iov_base, local[i].iov_len);
+                return 0;
+        }
 
+        /* Close the claims before touching the job, then open the new batch */
+        gen = (unsigned long long)(copy_gen + 1) << COPY_GEN_SHIFT;
+        __atomic_store_n(&j->claim, gen | COPY_COUNT_MASK, __ATOMIC_RELAXED);
+        __sync_synchronize();
+        j->local = local;
+        j->remote = remote;
+        j->n = n;
+        j->npiece = 0;
+        for(i=0;i<n;i++)
+        {
+                j->npiece += (local[i].iov_len + COPY_SPLIT - 1) / COPY_SPLIT;
+                j->piece_end[i] = j->npiece;
+        }
+        __atomic_store_n(&j->done, gen, __ATOMIC_RELAXED);
+        __sync_synchronize();
+        __atomic_store_n(&j->claim, gen, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&copy_lock);
+        copy_gen++;
+        pthread_cond_broadcast(&copy_cond);
+        pthread_mutex_unlock(&copy_lock);
+
+        copy_pieces(j);
+        while(__atomic_load_n(&j->done, __ATOMIC_ACQUIRE) != (gen | j->npiece))
+                sched_yield();
+        return 0;
+}
 
-                //PRPSINFO
-                nhdr = (Nhdr*)&mem[noffset+nsize];
-                memset((void*)nhdr, 0, sizeof(Nhdr));
-                nhdr->n_namesz   = 5;
-                nhdr->n_descsz   = sizeof(PRPSINFO);
-                nhdr->n_type     = NT_PRPSINFO;
+CAPTURE_FN capture = capture_self;
+int capture_pid;                /* Process being dumped, 0 for ourselves   */
 
-                name = (char*)&nhdr[1];
-                strncpy(name, CORE_STR, 4);
-                PRPSINFO *prpsinfo=(PRPSINFO*)(name + ALIGN(nhdr->n_namesz, 4) );
-                memset(prpsinfo, 0, sizeof(PRPSINFO));
-                prpsinfo->pr_pid = getpid()+thread;
-                prpsinfo->pr_state   = 0;
-                prpsinfo->pr_sname   = 'R';
-                prpsinfo->pr_zomb    = 0;
-
-                strcpy(prpsinfo->pr_fname, "vmlinux");
-                nsize += sizeof(Nhdr) + ALIGN(nhdr->n_namesz, 4) + nhdr->n_descsz;
-                prctl(PR_GET_NAME, prpsinfo->pr_psargs, 0L, 0L, 0L);
-
-
-                //USER INFO
-                nhdr = (Nhdr*)&mem[noffset+nsize];
-                memset((void*)nhdr, 0, sizeof(Nhdr));
-                nhdr->n_namesz   = 5;
-                nhdr->n_descsz   = sizeof( USER);
-                nhdr->n_type     = NT_PRXFPREG;
 
-                name = (char*)&nhdr[1];
-                strncpy(name, CORE_STR, 4);
-                USER *user=(USER*)(name + ALIGN(nhdr->n_namesz, 4) );
-                memset(user, 0, sizeof(USER));
-                //TODO
-                nsize += sizeof(Nhdr) + ALIGN(nhdr->n_namesz, 4) + nhdr->n_descsz;
+/*
+ * Dump statistics.  Every phase is timed with CLOCK_MONOTONIC and the TSC
+ * and added to dump_stats; with dump_trace set a line per phase goes to
+ * stderr.  Nothing here allocates, so it is safe on the crash path.
+ */
+DUMP_STATS dump_stats;
+int dump_trace;
 
+char *phase_name[DUMP_PHASE_MAX] = { "discover", "notes", "open", "copy", "write", "sync", "close" };
+char *region_name[REGION_MAX] = { "code", "data", "bss", "stack", "heap" };
 
-                //TASK STRUCT
-                nhdr = (Nhdr*)&mem[noffset+nsize];
-                memset((void*)nhdr, 0, sizeof(Nhdr));
-                nhdr->n_namesz   = 5;
-                nhdr->n_descsz   = sizeof( TASKSTRUCT);
-                nhdr->n_type     = NT_TASKSTRUCT;
+typedef struct phase_timer {
+        unsigned long long ns;
+        unsigned long long tsc;
+} PTIMER;
 
-                name = (char*)&nhdr[1];
-                strncpy(name, CORE_STR, 4);
-                TASKSTRUCT *ts =(TASKSTRUCT*)(name + ALIGN(nhdr->n_namesz, 4) );
-                memset(ts, 0, sizeof(TASKSTRUCT));
-                /*memcpy(ts, current, sizeof(TASKSTRUCT));*/
-                nsize += sizeof(Nhdr) + ALIGN(nhdr->n_namesz, 4) + nhdr->n_descsz;
+unsigned long long stats_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void phase_start(PTIMER *t)
+{
+        t->ns = stats_ns();
+        t->tsc = __builtin_ia32_rdtsc();
+}
+
+/* Close phase p of bytes; region type rt (or -1) also gets the copy time */
+void phase_end(PTIMER *t, int p, int rt, unsigned long long bytes)
+{
+        unsigned long long ns = stats_ns() - t->ns;
+        unsigned long long tsc = __builtin_ia32_rdtsc() - t->tsc;
+        char line[128];
+        int n;
+
+        dump_stats.phase[p].ns += ns;
+        dump_stats.phase[p].cycles += tsc;
+        dump_stats.phase[p].bytes += bytes;
+        dump_stats.phase[p].count++;
+        if(rt >= 0 && rt < REGION_MAX)
+        {
+                dump_stats.region[rt].ns += ns;
+                dump_stats.region[rt].cycles += tsc;
+                dump_stats.region[rt].bytes += bytes;
+                dump_stats.region[rt].count++;
+        }
+        if(dump_trace)
+        {
+                n = snprintf(line, sizeof(line), "dump: %-8s %-5s %12llu ns %12llu cycles %12llu bytes\n",
+                             phase_name[p], rt >= 0 && rt < REGION_MAX ? region_name[rt] : "",
+                             ns, tsc, bytes);
+                write(2, line, n);
+        }
+}
+
+/* A diagnostic line on stderr when dump_trace is set, without stdio */
+void dump_log(const char *fmt, ...)
+{
+        char line[256];
+        va_list ap;
+        int n;
+
+        if(!dump_trace)
+                return;
+        va_start(ap, fmt);
+        n = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+        if(n > (int)sizeof(line) - 1)
+                n = sizeof(line) - 1;
+        if(n > 0)
+                write(2, line, n);
+}
+
+/*
+ * Core writer.
+ *
+ * dump_core() produces the core strictly front to back into one of two
+ * page aligned WRITER_BUF buffers while a writer thread pwrite()s the
+ * other, so memory capture and disk I/O overlap.  dump_io picks how the
+ * data reaches the file:
+ *
+ *   DUMP_IO_CACHED      plain writes through the page cache
+ *   DUMP_IO_DROPBEHIND  writeback of each buffer is started with
+ *                       sync_file_range() and the previous one is dropped
+ *                       from the page cache with POSIX_FADV_DONTNEED
+ *   DUMP_IO_DIRECT      O_DIRECT; the tail is padded to DIRECT_ALIGN and
+ *                       truncated back.  Falls back to DUMP_IO_CACHED on
+ *                       filesystems without O_DIRECT
+ *
+ * dump_sync picks what is flushed before the dump returns: nothing, the
+ * file data (fdatasync) or the file and its directory entry (fsync).
+ *
+ * The two buffers are one staging area, allocated on first use (or ahead
+ * of time by dump_stage_init()) and kept, already faulted in, for later
+ * dumps.  dump_hugepages picks its backing, see segment.h.
+ */
+#define WRITER_BUF      (16*1024*1024)
+#define DIRECT_ALIGN    4096
+
+int dump_io = DUMP_IO_DROPBEHIND;
+int dump_sync = DUMP_SYNC_DATA;
+int dump_hugepages = DUMP_HUGE_THP;
+
+char *stage_buf;
+int stage_huge;                         /* DUMP_HUGE_* it actually got       */
+
+typedef struct writer {
+        int             fd;
+        int             io;
+        char            path[PATH_MAX];
+        char           *buf[2];
+        int             cur;            /* buffer being filled               */
+        unsigned long   len;            /* bytes filled in buf[cur]          */
+        unsigned long long off;         /* file offset of buf[cur]           */
+        int             busy;           /* buf[!cur] is with the writer      */
+        unsigned long   wlen;
+        unsigned long long woff;
+        unsigned long long dropped;     /* file bytes released from cache    */
+        int             stop;
+        int             error;
+        pthread_t       thread;
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+} WRITER;
+
+int writer_pwrite(WRITER *w, char *buf, unsigned long len, unsigned long long off)
+{
+        ssize_t n;
+
+        while(len)
+        {
+                n = pwrite(w->fd, buf, len, off);
+                if(n < 0 && errno == EINTR)
+                        continue;
+                if(n <= 0)
+                        return -1;
+                buf += n;
+                len -= n;
+                off += n;
+        }
+        return 0;
+}
+
+/* Wait for everything before off to reach the disk and drop it from cache */
+void writer_drop(WRITER *w, unsigned long long off)
+{
+        if(off <= w->dropped)
+                return;
+        sync_file_range(w->fd, w->dropped, off - w->dropped, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(w->fd, w->dropped, off - w->dropped, POSIX_FADV_DONTNEED);
+        w->dropped = off;
+}
+
+void *writer_main(void *arg)
+{
+        WRITER *w = (WRITER*)arg;
+        unsigned long long off;
+        unsigned long len;
+        char *buf;
 
+        pthread_mutex_lock(&w->lock);
+        for(;;)
+        {
+                while(!w->busy && !w->stop)
+                        pthread_cond_wait(&w->cond, &w->lock);
+                if(!w->busy)
+                        break;
+                buf = w->buf[!w->cur];
+                len = w->wlen;
+                off = w->woff;
+                pthread_mutex_unlock(&w->lock);
+
+                if(writer_pwrite(w, buf, len, off) < 0)
+                        w->error = errno;
+                else if(w->io == DUMP_IO_DROPBEHIND)
+                {
+                        sync_file_range(w->fd, off, len, SYNC_FILE_RANGE_WRITE);
+                        writer_drop(w, off);
+                }
+
+                pthread_mutex_lock(&w->lock);
+                w->busy = 0;
+                pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+        return NULL;
+}
+
+/* Hand buf[cur] to the writer thread and start filling the other buffer */
+void writer_flush(WRITER *w)
+{
+        PTIMER t;
+
+        phase_start(&t);
+        pthread_mutex_lock(&w->lock);
+        while(w->busy)
+                pthread_cond_wait(&w->cond, &w->lock);
+        w->wlen = w->len;
+        w->woff = w->off;
+        w->busy = 1;
+        w->off += w->len;
+        w->len = 0;
+        w->cur = !w->cur;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        phase_end(&t, DUMP_PHASE_WRITE, -1, w->wlen);
+}
+
+/* Free space in the current buffer, flushing it first when full */
+unsigned long writer_space(WRITER *w, char **p)
+{
+        if(w->len == WRITER_BUF)
+                writer_flush(w);
+        *p = w->buf[w->cur] + w->len;
+        return WRITER_BUF - w->len;
+}
+
+void writer_put(WRITER *w, void *data, unsigned long len)
+{
+        unsigned long n;
+        char *p;
+
+        while(len)
+        {
+                n = writer_space(w, &p);
+                if(n > len)
+                        n = len;
+                memcpy(p, data, n);
+                w->len += n;
+                data = (char*)data + n;
+                len -= n;
+        }
+}
+
+int dump_stage_init(void)
+{
+        unsigned long len = 2*WRITER_BUF, off;
+        char *p = MAP_FAILED, *a;
+
+        if(stage_buf)
+                return 0;
+        stage_huge = DUMP_HUGE_NONE;
+        if(dump_hugepages == DUMP_HUGE_HUGETLB)
+        {
+                /* Fails when the hugetlb pool can not supply it */
+                p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+                if(p != MAP_FAILED)
+                        stage_huge = DUMP_HUGE_HUGETLB;
+        }
+        if(p == MAP_FAILED && dump_hugepages != DUMP_HUGE_NONE)
+        {
+                /* Over-allocate so the area can start on a huge page boundary */
+                a = mmap(NULL, len + huge_page_size, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                if(a != MAP_FAILED)
+                {
+                        p = (char*)ALIGN((unsigned long)a, huge_page_size);
+                        if(p > a)
+                                munmap(a, p - a);
+                        munmap(p + len, a + huge_page_size - p);
+                        if(madvise(p, len, MADV_HUGEPAGE) == 0)
+                                stage_huge = DUMP_HUGE_THP;
+                }
+        }
+        if(p == MAP_FAILED)
+                p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+                return -1;
+        /* A forked dump helper allocates its own instead of sharing it COW */
+        madvise(p, len, MADV_DONTFORK);
+        if(stage_huge != DUMP_HUGE_HUGETLB && madvise(p, len, MADV_POPULATE_WRITE) < 0)
+                for(off=0;off<len;off+=page_size)
+                        p[off] = 0;
+        stage_buf = p;
+        return 0;
+}
+
+int writer_open(WRITER *w, char *filename)
+{
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+        memset(w, 0, sizeof(WRITER));
+        w->io = dump_io;
+        strncpy(w->path, filename, sizeof(w->path)-1);
+        w->fd = open(filename, flags | (w->io == DUMP_IO_DIRECT ? O_DIRECT : 0),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if(w->fd < 0 && w->io == DUMP_IO_DIRECT && errno == EINVAL)
+        {
+                w->io = DUMP_IO_CACHED;
+                w->fd = open(filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         }
+        if(w->fd < 0)
+                return -1;
+        if(dump_stage_init() < 0)
+        {
+                close(w->fd);
+                return -1;
+        }
+        w->buf[0] = stage_buf;
+        w->buf[1] = w->buf[0] + WRITER_BUF;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if(pthread_create(&w->thread, NULL, writer_main, w))
+        {
+                close(w->fd);
+                return -1;
+        }
+        return 0;
+}
+
+/* Flush the tail, stop the writer thread and apply dump_sync */
+int writer_close(WRITER *w)
+{
+        unsigned long long size = w->off + w->len;
+        unsigned long pad;
+        char dir[PATH_MAX];
+        PTIMER t;
+        int fd;
+
+        if(w->len)
+        {
+                if(w->io == DUMP_IO_DIRECT)
+                {
+                        pad = ALIGN(w->len, DIRECT_ALIGN) - w->len;
+                        memset(w->buf[w->cur] + w->len, 0, pad);
+                        w->len += pad;
+                }
+                writer_flush(w);
+        }
+        pthread_mutex_lock(&w->lock);
+        while(w->busy)
+                pthread_cond_wait(&w->cond, &w->lock);
+        w->stop = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        if(w->io == DUMP_IO_DIRECT)
+                ftruncate(w->fd, size);
+
+        phase_start(&t);
+        if(dump_sync == DUMP_SYNC_DATA)
+                fdatasync(w->fd);
+        else if(dump_sync == DUMP_SYNC_FULL)
+        {
+                fsync(w->fd);
+                strcpy(dir, w->path);
+                fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+                if(fd >= 0)
+                {
+                        fsync(fd);
+                        close(fd);
+                }
+        }
+        if(w->io == DUMP_IO_DROPBEHIND)
+                writer_drop(w, size);
+        phase_end(&t, DUMP_PHASE_SYNC, -1, size);
+
+        phase_start(&t);
+        close(w->fd);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        phase_end(&t, DUMP_PHASE_CLOSE, -1, 0);
+        return w->error ? -1 : 0;
+}
 
+/*
+ * Note helpers.  note_put() writes the header and owner of a note at p and
+ * pads its descriptor; desc is copied in unless it is NULL, in which case
+ * the caller has already built the descriptor at NOTE_DESC(p, owner).
+ * Returns the size the note takes.
+ */
+#define NOTE_DESC(p, owner)     ((char*)(p) + sizeof(Nhdr) + ALIGN(sizeof(owner), 4))
 
+int note_put(char *p, char *owner, int type, void *desc, unsigned long descsz)
+{
+        Nhdr *nhdr = (Nhdr*)p;
+        char *name = (char*)&nhdr[1];
+
+        nhdr->n_namesz = strlen(owner) + 1;
+        nhdr->n_descsz = descsz;
+        nhdr->n_type   = type;
+        memset(name, 0, ALIGN(nhdr->n_namesz, 4));
+        memcpy(name, owner, nhdr->n_namesz);
+        name += ALIGN(nhdr->n_namesz, 4);
+        if(desc)
+                memcpy(name, desc, descsz);
+        memset(name + descsz, 0, ALIGN(descsz, 4) - descsz);
+        return sizeof(Nhdr) + ALIGN(nhdr->n_namesz, 4) + ALIGN(descsz, 4);
+}
 
+/* Read /proc/<pid>/<file> of the process being dumped; returns the length */
+int proc_read(char *file, char *buf, int len)
+{
+        char path[64];
+        int fd, n, got = 0;
+
+        if(capture_pid)
+                sprintf(path, "/proc/%d/%s", capture_pid, file);
+        else
+                sprintf(path, "/proc/self/%s", file);
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return 0;
+        while(got < len && (n = read(fd, buf + got, len - got)) > 0)
+                got += n;
+        close(fd);
+        return got;
+}
 
+typedef struct proc_stat {
+        char           state;
+        int            ppid, pgrp, sid, nice;
+} PROC_STAT;
 
+void proc_stat(PROC_STAT *st)
+{
+        char buf[512], *p;
+        int n;
+
+        memset(st, 0, sizeof(*st));
+        n = proc_read("stat", buf, sizeof(buf)-1);
+        buf[n] = 0;
+        /* comm may hold spaces and parentheses, fields start after the last ')' */
+        p = strrchr(buf, ')');
+        if(p)
+                sscanf(p + 2, "%c %d %d %d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %d",
+                       &st->state, &st->ppid, &st->pgrp, &st->sid, &st->nice);
+}
 
+int note_file(char *desc, unsigned long room);
+int note_build_id(char *desc, unsigned long room);
 
-        int soffset = noffset + nsize;
-        char *stack = (char*)&mem[soffset];
-        memcpy(stack, (char*)r[REGION_STACK].start, r[REGION_STACK].size);
-        int ssize = r[REGION_STACK].size;
+void dump_core(WRITER *w, THREAD_SLOT *slot, int nslot, REGION *r, int count)
 
-        int hoffset = soffset + ssize;
-        char *heap = (char*)&mem[hoffset];
-        memcpy(heap, (char*)r[REGION_HEAP].start, r[REGION_HEAP].size);
-        int hsize = r[REGION_HEAP].size;
+{
 
 
-        int doffset = hoffset + hsize;
-        char *data = (char*)&mem[doffset];
-        memcpy(data, (char*)r[REGION_DATA].start, r[REGION_DATA].size);
-        int dsize = r[REGION_DATA].size;
 
+        char *mem = NULL;
+        Ehdr *ehdr = NULL;
+        char *desc;
+        int nsize = 0;
+        PRSTATUS prstatus;
+        PRPSINFO prpsinfo;
+        PROC_STAT st;
+        int thread=0;
+        int i, got;
+        unsigned long room;
+        PTIMER t;
 
-        int boffset = doffset + dsize;
-        char *bss = (char*)&mem[boffset];
-        memcpy(bss, (char*)r[REGION_BSS].start, r[REGION_BSS].size);
-        int bsize = r[REGION_BSS].size;
+        phase_start(&t);
 
-        int poffset = boffset + bsize;
-        int pcount=0;
-        Phdr *phdr = (Phdr*)&mem[poffset];
+        /* Header and notes go straight into the first, empty, buffer */
+        room = writer_space(w, &mem);
+        ehdr = (Ehdr *)mem;
+        memset(ehdr, 0, sizeof(Ehdr));
 
-        phdr[pcount].p_type = PT_NOTE;
-        phdr[pcount].p_offset = noffset;
-        phdr[pcount].p_vaddr =0;
-        phdr[pcount].p_paddr =0;
-        phdr[pcount].p_filesz = nsize;
-        phdr[pcount].p_memsz = phdr->p_filesz;
-        phdr[pcount].p_flags = 0;
-        phdr[pcount].p_align = 0;
-        pcount++;
 
 
-        phdr[pcount].p_type   = PT_LOAD;
-        phdr[pcount].p_offset = soffset;
-        phdr[pcount].p_vaddr  = r[REGION_STACK].start;
-        phdr[pcount].p_paddr  = 0;
-        phdr[pcount].p_filesz = r[REGION_STACK].size;
-        phdr[pcount].p_memsz  = phdr[1].p_filesz;
-        phdr[pcount].p_flags  = PF_R|PF_W;
-        phdr[pcount].p_align  = PAGE_SIZE;
-        pcount++;
+        int noffset =  sizeof(Ehdr);
+        /* Write note section                                                */
+        /*
+         * Same layout as a kernel core: every thread's NT_PRSTATUS is
+         * followed by its own FPU, xstate and siginfo notes, and the
+         * process wide notes follow the first thread.
+         */
+        proc_stat(&st);
+        for(thread=0;thread<nslot;thread++)
+        {
+                //PRSTATUS
+                memset(&prstatus, 0, sizeof(prstatus));
+                prstatus.pr_info.si_signo = slot[thread].info.si_signo;
+                prstatus.pr_info.si_code = slot[thread].info.si_code;
+                prstatus.pr_info.si_errno = slot[thread].info.si_errno;
+                prstatus.pr_cursig = slot[thread].info.si_signo;
+                prstatus.pr_pid = slot[thread].tid;
+                prstatus.pr_ppid = st.ppid;
+                prstatus.pr_pgrp = st.pgrp;
+                prstatus.pr_sid = st.sid;
+                prstatus.pr_reg = slot[thread].regs;
+                prstatus.pr_fpvalid = 1;
+                nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_PRSTATUS,
+                                  &prstatus, sizeof(prstatus));
+
+                if(thread == 0)
+                {
+                        //PRPSINFO
+                        memset(&prpsinfo, 0, sizeof(prpsinfo));
+                        prpsinfo.pr_sname = st.state;
+                        prpsinfo.pr_state = st.state == 'R' ? 0 : st.state == 'S' ? 1 :
+                                            st.state == 'D' ? 2 : st.state == 'T' ? 3 : 4;
+                        prpsinfo.pr_nice = st.nice;
+                        prpsinfo.pr_uid = getuid();
+                        prpsinfo.pr_gid = getgid();
+                        prpsinfo.pr_pid = capture_pid ? capture_pid : getpid();
+                        prpsinfo.pr_ppid = st.ppid;
+                        prpsinfo.pr_pgrp = st.pgrp;
+                        prpsinfo.pr_sid = st.sid;
+                        got = proc_read("comm", prpsinfo.pr_fname, sizeof(prpsinfo.pr_fname)-1);
+                        if(got && prpsinfo.pr_fname[got-1] == '\n')
+                                prpsinfo.pr_fname[got-1] = 0;
+                        /* Arguments are NUL separated in cmdline */
+                        got = proc_read("cmdline", prpsinfo.pr_psargs, sizeof(prpsinfo.pr_psargs)-1);
+                        for(i=0;i<got-1;i++)
+                                if(!prpsinfo.pr_psargs[i])
+                                        prpsinfo.pr_psargs[i] = ' ';
+                        nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_PRPSINFO,
+                                          &prpsinfo, sizeof(prpsinfo));
+
+                        //AUXV
+                        desc = NOTE_DESC(&mem[noffset+nsize], CORE_STR);
+                        got = proc_read("auxv", desc, room - (desc - mem));
+                        nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_AUXV, NULL, got);
+
+                        //FILE
+                        desc = NOTE_DESC(&mem[noffset+nsize], CORE_STR);
+                        got = note_file(desc, room - (desc - mem));
+                        nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_FILE, NULL, got);
+                }
+
+                //FPU
+                nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_FPREGSET,
+                                  slot[thread].fsave, FSAVE_SIZE);
+                nsize += note_put(&mem[noffset+nsize], "LINUX", NT_PRXFPREG,
+                                  slot[thread].fxsave, FXSAVE_SIZE);
+                if(slot[thread].xstate_size)
+                        nsize += note_put(&mem[noffset+nsize], "LINUX", NT_X86_XSTATE,
+                                          slot[thread].xstate, slot[thread].xstate_size);
+
+                //SIGINFO
+                nsize += note_put(&mem[noffset+nsize], CORE_STR, NT_SIGINFO,
+                                  &slot[thread].info, sizeof(siginfo_t));
+        }
 
-        phdr[pcount].p_type   = PT_LOAD;
-        phdr[pcount].p_offset = hoffset;
-        phdr[pcount].p_vaddr  = r[REGION_HEAP].start;
-        phdr[pcount].p_paddr  = 0;
-        phdr[pcount].p_filesz = r[REGION_HEAP].size;
-        phdr[pcount].p_memsz  = phdr[1].p_filesz;
-        phdr[pcount].p_flags  = PF_R|PF_W;
-        phdr[pcount].p_align  = PAGE_SIZE;
-        pcount++;
+        //BUILD IDS
+        desc = NOTE_DESC(&mem[noffset+nsize], SFRAME_STR);
+        got = note_build_id(desc, room - (desc - mem));
+        if(got)
+                nsize += note_put(&mem[noffset+nsize], SFRAME_STR, NT_SFRAME_BUILD_ID, NULL, got);
 
+        //ARENA LIST
+        if(narena)
+                nsize += note_put(&mem[noffset+nsize], SFRAME_STR, NT_SFRAME_ARENA,
+                                  arena, narena * sizeof(ARENA));
 
-        phdr[pcount].p_type   = PT_LOAD;
-        phdr[pcount].p_offset = doffset;
-        phdr[pcount].p_vaddr  = r[REGION_DATA].start;
-        phdr[pcount].p_paddr  = 0;
-        phdr[pcount].p_filesz = r[REGION_DATA].size;
-        phdr[pcount].p_memsz  = phdr[1].p_filesz;
-        phdr[pcount].p_flags  = PF_R|PF_W;
-        phdr[pcount].p_align  = PAGE_SIZE;
-        pcount++;
+        //FLIGHT RECORDER
+        if(flight_niov)
+        {
+                struct iovec local[FLIGHT_IOV];
+                unsigned long len = 0;
+
+                desc = NOTE_DESC(&mem[noffset+nsize], SFRAME_STR);
+                /* Rings that do not fit the first buffer are left out */
+                for(i=0;i<flight_niov && len + flight_iov[i].iov_len <= room - (desc - mem);i++)
+                {
+                        local[i].iov_base = desc + len;
+                        local[i].iov_len  = flight_iov[i].iov_len;
+                        len += flight_iov[i].iov_len;
+                }
+                capture(local, flight_iov, i);
+                nsize += note_put(&mem[noffset+nsize], SFRAME_STR, NT_SFRAME_FLIGHT, NULL, len);
+        }
 
-        phdr[pcount].p_type   = PT_LOAD;
-        phdr[pcount].p_offset = boffset;
-        phdr[pcount].p_vaddr  = r[REGION_BSS].start;
-        phdr[pcount].p_paddr  = 0;
-        phdr[pcount].p_filesz = r[REGION_BSS].size;
-        phdr[pcount].p_memsz  = phdr[1].p_filesz;
-        phdr[pcount].p_flags  = PF_R|PF_W;
-        phdr[pcount].p_align  = PAGE_SIZE;
-        pcount++;
+        int poffset = noffset + nsize;
+        int pcount = count + 1;
+        for(i=0;i<count;i++)
+                poffset += r[i].size;
+        w->len += noffset + nsize;
 
         ehdr->e_ident[0] = ELFMAG0;
         ehdr->e_ident[1] = ELFMAG1;
@@ -412,9 +1156,80 @@ void dump_core(int handle, char *mem, REGS regs, REGION *r)
         ehdr->e_phentsize= sizeof(Phdr);
         ehdr->e_shentsize= sizeof(Shdr);
         ehdr->e_shstrndx = 0;
+        phase_end(&t, DUMP_PHASE_NOTES, -1, nsize);
+
+        /*
+         * Capture straight into the writer buffers.  A batch ends when the
+         * buffer is full or the region type changes, so the copy stats can
+         * split by type.
+         */
+        struct iovec local[CAPTURE_IOV], remote[CAPTURE_IOV];
+        unsigned long long bytes;
+        unsigned long done = 0, space, n;
+        REGION_TYPE type;
+        int niov;
+        char *p;
 
-}
+        i = 0;
+        while(i < count)
+        {
+                phase_start(&t);
+                space = writer_space(w, &p);
+                type = r[i].type;
+                niov = 0;
+                bytes = 0;
+                while(i < count && space && niov < CAPTURE_IOV && r[i].type == type)
+                {
+                        n = r[i].size - done;
+                        if(n > space)
+                                n = space;
+                        local[niov].iov_base  = p;
+                        local[niov].iov_len   = n;
+                        remote[niov].iov_base = (char*)r[i].start + done;
+                        remote[niov].iov_len  = n;
+                        niov++;
+                        p += n;
+                        space -= n;
+                        bytes += n;
+                        done += n;
+                        if(done == r[i].size)
+                        {
+                                i++;
+                                done = 0;
+                        }
+                }
+                capture(local, remote, niov);
+                w->len += bytes;
+                phase_end(&t, DUMP_PHASE_COPY, type, bytes);
+        }
 
+        Phdr phdr;
+        memset(&phdr, 0, sizeof(phdr));
+        phdr.p_type = PT_NOTE;
+        phdr.p_offset = noffset;
+        phdr.p_vaddr =0;
+        phdr.p_paddr =0;
+        phdr.p_filesz = nsize;
+        phdr.p_memsz = phdr.p_filesz;
+        phdr.p_flags = 0;
+        phdr.p_align = 0;
+        writer_put(w, &phdr, sizeof(phdr));
+
+        int offset = noffset + nsize;
+        for(i=0;i<count;i++)
+        {
+                phdr.p_type   = PT_LOAD;
+                phdr.p_offset = offset;
+                phdr.p_vaddr  = r[i].start;
+                phdr.p_paddr  = 0;
+                phdr.p_filesz = r[i].size;
+                phdr.p_memsz  = r[i].size;
+                phdr.p_flags  = PF_R|PF_W;
+                phdr.p_align  = page_size;
+                offset += r[i].size;
+                writer_put(w, &phdr, sizeof(phdr));
+        }
+}
 #include <malloc.h>
 #include <stdio.h>
 #include <assert.h>
@@ -497,8 +1312,61 @@ void dump_core(int handle, char *mem, REGS regs, REGION *r)
 
 
 
-REGION region[REGION_MAX];
-#define CORE_SIZE 512*1024
+/*
+ * /proc/<pid>/maps reader, pid 0 being ourselves.  Uses read(2) into a
+ * static buffer so it can run on the dump path without popen() or
+ * malloc().  fn() returns non-zero to stop the walk.
+ */
+typedef struct map_entry
+{
+        unsigned long start;
+        unsigned long end;
+        unsigned long offset;
+        unsigned long inode;
+        char perms[5];
+        char path[256];
+}MAP;
+
+int read_maps(int pid, int (*fn)(MAP *m, void *arg), void *arg)
+{
+        static char buf[4096];
+        static char line[512];
+        char path[64];
+        int fd, n, i, len = 0, stop = 0;
+        MAP m;
+
+        if(pid)
+                sprintf(path, "/proc/%d/maps", pid);
+        else
+                strcpy(path, "/proc/self/maps");
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return -1;
+        while(!stop && (n = read(fd, buf, sizeof(buf))) > 0)
+        {
+                for(i=0;i<n && !stop;i++)
+                {
+                        if(buf[i] != '\n')
+                        {
+                                if(len < (int)sizeof(line)-1)
+                                        line[len++] = buf[i];
+                                continue;
+                        }
+                        line[len] = 0;
+                        len = 0;
+                        memset(&m, 0, sizeof(m));
+                        if(sscanf(line, "%lx-%lx %4s %lx %*s %lu %255s",
+                                  &m.start, &m.end, m.perms, &m.offset, &m.inode, m.path) < 5)
+                                continue;
+                        stop = fn(&m, arg);
+                }
+        }
+        close(fd);
+        return 0;
+}
+
+REGION region[MAX_REGION];
+int nregion;
 #if 0
 void get_current_stack(int *start, int *end)
 {
@@ -512,47 +1380,704 @@ void get_current_stack(int *start, int *end)
 
 }
 #endif
+REGION *add_region(REGION_TYPE type, unsigned long start, unsigned long end)
+{
+        REGION *r;
+
+        /* Heap runs may not take the slots of the fixed regions */
+        if(nregion >= MAX_REGION - (type == REGION_HEAP ? REGION_RESERVE : 0))
+                return NULL;
+        r = &region[nregion++];
+        r->type = type;
+        r->start = start;
+        r->end = end;
+        r->size = end - start;
+        r->valid = 1;
+        return r;
+}
+typedef struct region_scan {
+        REGION        *r;
+        char          *type;
+        int            found;
+} REGION_SCAN;
+
+/* The first [type] mapping, plus the adjacent [type] lines following it */
+int region_map(MAP *m, void *arg)
+{
+        REGION_SCAN *rs = arg;
+        int len = strlen(rs->type);
+        int match = m->path[0] == '[' && !strncmp(m->path + 1, rs->type, len) &&
+                    m->path[len+1] == ']';
+
+        if(!rs->found)
+        {
+                if(match)
+                {
+                        rs->r->start = m->start;
+                        rs->r->end = m->end;
+                        rs->found = 1;
+                }
+                return 0;
+        }
+        /* A forked child's [heap] can show up as several adjacent lines */
+        if(!match || m->start != rs->r->end)
+                return 1;
+        rs->r->end = m->end;
+        return 0;
+}
+
 void get_region(REGION *r, char *type)
 {
-        char cmd[512]="";
+        REGION_SCAN rs;
 
-        sprintf(cmd, "cat /proc/%d/maps|grep %s", getpid(), type );
-        FILE *fp = popen(cmd, "r");
-        assert(fp);
-        fscanf(fp, "%x-%x", &r->start, &r->end);
+        r->start = r->end = 0;
+        rs.r = r;
+        rs.type = type;
+        rs.found = 0;
+        read_maps(0, region_map, &rs);
         r->size = r->end - r->start;
         r->valid = 1;
-        printf("[ %s ] start:%x, end:%x\n", type, r->start, r->end);
-        fclose(fp);
+        dump_log("[ %s ] start:%lx, end:%lx\n", type, r->start, r->end);
+}
+/*
+ * Writable segments of every loaded object, from dl_iterate_phdr().  Each
+ * writable PT_LOAD gives a REGION_DATA run for its file backed part and a
+ * REGION_BSS run for the zero filled rest; a PT_GNU_RELRO range outside
+ * them (it normally sits at the head of the first one) is added as data.
+ * The table is only rebuilt when the loader's dlpi_adds/dlpi_subs
+ * counters say an object was loaded or unloaded since the last walk.
+ *
+ * The same walk records each object's load address and GNU build-id for
+ * the NT_SFRAME_BUILD_ID note, and the page holding its ELF header is
+ * dumped as REGION_CODE, which is where debuggers look for build-ids.
+ */
+#define MAX_OBJ_SEG     512
+#define MAX_OBJ         256
+#define OBJ_ID_MAX      32
+
+typedef struct obj_id {         /* One NT_SFRAME_BUILD_ID record             */
+        unsigned long  base;          /* Address of the ELF header           */
+        unsigned long  id_size;       /* 0: object has no build-id           */
+        unsigned char  id[OBJ_ID_MAX];
+        char           path[128];     /* Truncated                           */
+} OBJ_ID;
+
+OBJ_ID obj_id[MAX_OBJ];
+int nobj_id;
+
+typedef struct obj_seg {
+        REGION_TYPE    type;
+        unsigned long  start;
+        unsigned long  end;
+} OBJ_SEG;
+
+OBJ_SEG obj_seg[MAX_OBJ_SEG];
+int nobj_seg;
+unsigned long long obj_adds, obj_subs;
+int obj_valid;
+
+void obj_add(REGION_TYPE type, unsigned long start, unsigned long end)
+{
+        if(start >= end || nobj_seg >= MAX_OBJ_SEG)
+                return;
+        obj_seg[nobj_seg].type = type;
+        obj_seg[nobj_seg].start = start;
+        obj_seg[nobj_seg].end = end;
+        nobj_seg++;
+}
+
+int obj_count(struct dl_phdr_info *info, size_t size, void *arg)
+{
+        unsigned long long *count = (unsigned long long*)arg;
 
+        count[0] = info->dlpi_adds;
+        count[1] = info->dlpi_subs;
+        return 1;
 }
-extern char __data_start[];
-extern char _edata[];
-void get_region_data(REGION *r)
+
+void obj_build_id(OBJ_ID *o, char *p, unsigned long size)
 {
-        printf("[ DATA ] start:%x, end:%x\n", __data_start, _edata);
-        r->start = (int)__data_start;
-        r->end =  (int)_edata;
-        r->size = (int)(_edata-__data_start);
-        r->valid = 1;
+        Nhdr *nhdr;
+        char *end = p + size, *name;
 
+        while(p + sizeof(Nhdr) <= end)
+        {
+                nhdr = (Nhdr*)p;
+                name = (char*)&nhdr[1];
+                p = name + ALIGN(nhdr->n_namesz, 4) + ALIGN(nhdr->n_descsz, 4);
+                if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                   !memcmp(name, "GNU", 4) && nhdr->n_descsz <= OBJ_ID_MAX)
+                {
+                        o->id_size = nhdr->n_descsz;
+                        memcpy(o->id, name + 4, nhdr->n_descsz);
+                        return;
+                }
+        }
 }
-int a[256];
-extern char __bss_start[];
-extern char _end[];
-void get_region_bss(REGION *r)
+
+int obj_segments(struct dl_phdr_info *info, size_t size, void *arg)
 {
-        /*char *__bss_end = region[REGION_HEAP].end;*/
-        /*char *__bss_end = (char*)( ( (int)(__bss_start) + 4096)& (~4096) );*/
-        char *__bss_end = (char*)_end;
-        printf("[ BSS ] start:%x, end:%x\n", __bss_start, __bss_end);
-        r->start = (int)__bss_start;
-        r->end =  (int)__bss_end;
-        r->size = (int)(__bss_end-__bss_start);
-        r->valid = 1;
-        a[0]=0xAABBCCDD;
+        const Phdr *ph;
+        unsigned long start, file, end, rs, re;
+        int i, j, first = nobj_seg;
+        OBJ_ID *o = nobj_id < MAX_OBJ ? &obj_id[nobj_id] : NULL;
+
+        if(o)
+        {
+                memset(o, 0, sizeof(*o));
+                if(info->dlpi_name[0])
+                        strncpy(o->path, info->dlpi_name, sizeof(o->path)-1);
+                else
+                        readlink("/proc/self/exe", o->path, sizeof(o->path)-1);
+        }
 
+        for(i=0;i<info->dlpi_phnum;i++)
+        {
+                ph = &info->dlpi_phdr[i];
+                if(o && ph->p_type == PT_NOTE && !o->id_size)
+                        obj_build_id(o, (char*)(info->dlpi_addr + ph->p_vaddr), ph->p_memsz);
+                if(o && ph->p_type == PT_LOAD && ph->p_offset == 0)
+                        o->base = (info->dlpi_addr + ph->p_vaddr) & ~(page_size-1);
+                if(ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+                        continue;
+                start = info->dlpi_addr + ph->p_vaddr;
+                file = start + ph->p_filesz;
+                end = ALIGN(start + ph->p_memsz, page_size);
+                obj_add(REGION_DATA, start & ~(page_size-1), file);
+                obj_add(REGION_BSS, file, end);
+        }
+        for(i=0;i<info->dlpi_phnum;i++)
+        {
+                ph = &info->dlpi_phdr[i];
+                if(ph->p_type != PT_GNU_RELRO)
+                        continue;
+                rs = (info->dlpi_addr + ph->p_vaddr) & ~(page_size-1);
+                re = ALIGN(info->dlpi_addr + ph->p_vaddr + ph->p_memsz, page_size);
+                /* Trim off what the writable segments already cover */
+                for(j=first;j<nobj_seg;j++)
+                {
+                        if(obj_seg[j].start <= rs && rs < obj_seg[j].end)
+                                rs = obj_seg[j].end;
+                        if(obj_seg[j].start < re && re <= obj_seg[j].end)
+                                re = obj_seg[j].start;
+                }
+                obj_add(REGION_DATA, rs, re);
+        }
+        if(o && o->base)
+                nobj_id++;
+        return 0;
+}
+
+/* Rebuild obj_seg[] if objects came or went since the last call */
+void get_obj_segments(void)
+{
+        unsigned long long count[2] = { 0, 0 };
+
+        dl_iterate_phdr(obj_count, count);
+        if(obj_valid && count[0] == obj_adds && count[1] == obj_subs)
+                return;
+        nobj_seg = 0;
+        nobj_id = 0;
+        dl_iterate_phdr(obj_segments, NULL);
+        obj_adds = count[0];
+        obj_subs = count[1];
+        obj_valid = 1;
+        dump_log("[ OBJECTS ] %d writable segments\n", nobj_seg);
 }
+
+void get_region_objects(void)
+{
+        int i;
+
+        get_obj_segments();
+        for(i=0;i<nobj_seg;i++)
+                add_region(obj_seg[i].type, obj_seg[i].start, obj_seg[i].end);
+        for(i=0;i<nobj_id;i++)
+                add_region(REGION_CODE, obj_id[i].base, obj_id[i].base + page_size);
+}
+
+int note_build_id(char *desc, unsigned long room)
+{
+        unsigned long size = nobj_id * sizeof(OBJ_ID);
+
+        if(size > room)
+                return 0;
+        memcpy(desc, obj_id, size);
+        return size;
+}
+
+
+
+/*
+ * Huge page backed ranges of the process being dumped, from smaps:
+ * hugetlb mappings (KernelPageSize above the base page) and mappings
+ * with transparent huge pages in use.  They only decide how far skipped
+ * free chunks are rounded in, so a stale table costs a few pages of
+ * core at most.  smaps is slow to produce, so it is read once, by the
+ * first chunk mode dump or ahead of time by dump_huge_refresh(), not on
+ * every dump.
+ */
+#define MAX_HUGE        256
+
+typedef struct huge_range {
+        unsigned long  start;
+        unsigned long  end;
+        unsigned long  size;          /* Page size to handle it at           */
+} HUGE_RANGE;
+
+HUGE_RANGE huge[MAX_HUGE];
+int nhuge;
+int huge_read;                  /* huge[] has been read from smaps        */
+
+void huge_add(unsigned long start, unsigned long end, unsigned long kernel_kb,
+              unsigned long thp_kb)
+{
+        unsigned long size = 0;
+
+        if(kernel_kb * 1024 > page_size)
+                size = kernel_kb * 1024;
+        else if(thp_kb)
+                size = huge_page_size;
+        if(!size || nhuge == MAX_HUGE)
+                return;
+        huge[nhuge].start = start;
+        huge[nhuge].end = end;
+        huge[nhuge].size = size;
+        nhuge++;
+}
+
+void get_huge_ranges(void)
+{
+        static char buf[4096];
+        static char line[512];
+        unsigned long start = 0, end = 0, kernel_kb = 0, thp_kb = 0, a, b, kb;
+        char path[64];
+        int fd, n, i, len = 0;
+
+        nhuge = 0;
+        if(capture_pid)
+                sprintf(path, "/proc/%d/smaps", capture_pid);
+        else
+                strcpy(path, "/proc/self/smaps");
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return;
+        while((n = read(fd, buf, sizeof(buf))) > 0)
+        {
+                for(i=0;i<n;i++)
+                {
+                        if(buf[i] != '\n')
+                        {
+                                if(len < (int)sizeof(line)-1)
+                                        line[len++] = buf[i];
+                                continue;
+                        }
+                        line[len] = 0;
+                        len = 0;
+                        if(sscanf(line, "%lx-%lx ", &a, &b) == 2)
+                        {
+                                huge_add(start, end, kernel_kb, thp_kb);
+                                start = a;
+                                end = b;
+                                kernel_kb = thp_kb = 0;
+                        }
+                        else if(sscanf(line, "KernelPageSize: %lu kB", &kb) == 1)
+                                kernel_kb = kb;
+                        else if(sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                                sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+                                sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1)
+                                thp_kb += kb;
+                }
+        }
+        huge_add(start, end, kernel_kb, thp_kb);
+        close(fd);
+        huge_read = 1;
+}
+
+/* Re-read the huge page ranges now, outside the dump path */
+void dump_huge_refresh(void)
+{
+        get_huge_ranges();
+}
+
+/* Page size addr is handled at: its huge page size, or 0 for base pages */
+unsigned long huge_at(unsigned long addr)
+{
+        int i;
+
+        for(i=0;i<nhuge;i++)
+                if(addr >= huge[i].start && addr < huge[i].end)
+                        return huge[i].size;
+        return 0;
+}
+
+/*
+ * NT_FILE: count, page size, then start/end/page offset of every file
+ * backed mapping, then their NUL terminated paths in the same order.
+ */
+typedef struct file_note {
+        unsigned long *ent;
+        char          *names;
+        int            count;
+        int            max;
+        char          *names_end;
+} FILE_NOTE;
+
+int file_count(MAP *m, void *arg)
+{
+        if(m->path[0] == '/')
+                (*(int*)arg)++;
+        return 0;
+}
+
+int file_add(MAP *m, void *arg)
+{
+        FILE_NOTE *f = (FILE_NOTE*)arg;
+        int len = strlen(m->path) + 1;
+
+        if(m->path[0] != '/')
+                return 0;
+        if(f->count == f->max || f->names + len > f->names_end)
+                return 1;
+        f->ent[f->count*3]   = m->start;
+        f->ent[f->count*3+1] = m->end;
+        f->ent[f->count*3+2] = m->offset / page_size;
+        memcpy(f->names, m->path, len);
+        f->names += len;
+        f->count++;
+        return 0;
+}
+
+int note_file(char *desc, unsigned long room)
+{
+        unsigned long *hdr = (unsigned long*)desc;
+        FILE_NOTE f;
+        int max = 0;
+
+        read_maps(capture_pid, file_count, &max);
+        if(room < (2 + 3 * max) * sizeof(unsigned long))
+                return 0;
+        f.ent = &hdr[2];
+        f.names = (char*)&hdr[2 + 3 * max];
+        f.names_end = desc + room;
+        f.count = 0;
+        f.max = max;
+        read_maps(capture_pid, file_add, &f);
+        /* Mappings may have gone between the passes: close the gap */
+        if(f.count < max)
+        {
+                memmove(&hdr[2 + 3 * f.count], &hdr[2 + 3 * max],
+                        f.names - (char*)&hdr[2 + 3 * max]);
+                f.names -= 3 * (max - f.count) * sizeof(unsigned long);
+        }
+        hdr[0] = f.count;
+        hdr[1] = page_size;
+        return f.names - desc;
+}
+
+
+/*
+ * glibc malloc internals needed by the heap walker.  These mirror the
+ * i386 layout of glibc >= 2.27 (MALLOC_ALIGNMENT 16, have_fastchunks in
+ * malloc_state, HEAP_MAX_SIZE of 1MB).  Everything read through them is
+ * range checked, and a heap that does not parse is dumped whole.
+ * NFASTBINS is worked out from SIZE_SZ and MALLOC_ALIGN the way malloc.c
+ * does, 11 on i386, as every malloc_state field after it depends on it.
+ */
+#define SIZE_SZ         sizeof(unsigned long)
+#define MALLOC_ALIGN    16
+#define MALLOC_MASK     (MALLOC_ALIGN-1)
+#define MIN_CHUNK       16
+#define MAX_FAST_SIZE   (80 * SIZE_SZ / 4)
+#define request2size(req) ((req) + SIZE_SZ + MALLOC_MASK < MIN_CHUNK ? MIN_CHUNK : \
+                           ((req) + SIZE_SZ + MALLOC_MASK) & ~MALLOC_MASK)
+#define fastbin_index(sz) ((((unsigned int)(sz)) >> (SIZE_SZ == 8 ? 4 : 3)) - 2)
+#define PREV_INUSE      0x1
+#define IS_MMAPPED      0x2
+#define NON_MAIN_ARENA  0x4
+#define SIZE_BITS       (PREV_INUSE|IS_MMAPPED|NON_MAIN_ARENA)
+#define HEAP_MAX_SIZE   (1024*1024)
+#define NFASTBINS       (fastbin_index(request2size(MAX_FAST_SIZE)) + 1)
+#define NBINS           128
+#define BINMAPSIZE      4
+#define FREE_CHUNK_HDR  (6*SIZE_SZ)     /* prev_size, size, fd, bk, fd/bk_nextsize */
+
+typedef struct malloc_chunk {
+        unsigned long  prev_size;
+        unsigned long  size;
+} CHUNK;
+
+typedef struct malloc_state {
+        int            mutex;
+        int            flags;
+        int            have_fastchunks;
+        CHUNK         *fastbins[NFASTBINS];
+        CHUNK         *top;
+        CHUNK         *last_remainder;
+        CHUNK         *bins[NBINS*2-2];
+        unsigned int   binmap[BINMAPSIZE];
+        struct malloc_state *next;
+        struct malloc_state *next_free;
+        unsigned long  attached_threads;
+        unsigned long  system_mem;
+        unsigned long  max_system_mem;
+} MSTATE;
+
+typedef struct heap_info {
+        MSTATE        *ar_ptr;
+        struct heap_info *prev;
+        unsigned long  size;
+        unsigned long  mprotect_size;
+} HEAP_INFO;
+
+#define chunksize(c)    ((c)->size & ~SIZE_BITS)
+
+/* First chunk at or after addr whose user pointer is MALLOC_ALIGN aligned */
+unsigned long chunk_align(unsigned long addr)
+{
+        return ALIGN(addr + 2*SIZE_SZ, MALLOC_ALIGN) - 2*SIZE_SZ;
+}
+
+/*
+ * Walk the chunks of one heap segment and add a REGION_HEAP per run of
+ * in-use chunks.  A chunk is in use when the next chunk has PREV_INUSE set,
+ * so fastbin and tcache chunks are kept.  Stops at the top chunk (keeping
+ * its header), taken to be the chunk ending the segment when the arena is
+ * unknown, or at a fencepost.  Returns -1 on a corrupt chunk.
+ *
+ * In huge page backed memory only the whole huge pages inside a free
+ * chunk are left out: a THP heap then splits into a few PT_LOADs of whole
+ * huge pages instead of one per free chunk.
+ */
+int walk_heap(ARENA *d, unsigned long first)
+{
+        unsigned long p = first, run = first, next, sz, lo, hi, hp;
+        int base = nregion;
+        CHUNK *c, *n;
+
+        while(p + sizeof(CHUNK) <= d->heap_end)
+        {
+                c = (CHUNK*)p;
+                sz = chunksize(c);
+                if(!d->top && sz && p + sz == d->heap_end)
+                        d->top = p;
+                if(p == d->top || sz == 0)
+                {
+                        if(p == d->top)
+                                d->free += d->heap_end - p;
+                        p += sizeof(CHUNK);
+                        break;
+                }
+                if(sz < MIN_CHUNK || (sz & MALLOC_MASK) || p + sz > d->heap_end)
+                {
+                        nregion = base;
+                        return -1;
+                }
+                next = p + sz;
+                n = (CHUNK*)next;
+                if(next + sizeof(CHUNK) > d->heap_end || (n->size & PREV_INUSE))
+                {
+                        d->inuse += sz;
+                }
+                else
+                {
+                        d->free += sz;
+                        lo = p + FREE_CHUNK_HDR;
+                        hi = next;
+                        if((hp = huge_at(lo)))
+                        {
+                                lo = ALIGN(lo, hp);
+                                hi &= ~(hp-1);
+                        }
+                        /* With the table nearly full free chunks stay in the run */
+                        if(hi > lo && hi - lo >= HEAP_SKIP_MIN &&
+                           nregion < MAX_REGION - REGION_RESERVE - 1)
+                        {
+                                add_region(REGION_HEAP, run, lo);
+                                run = hi;
+                        }
+                }
+                p = next;
+        }
+        if(p > run && !add_region(REGION_HEAP, run, p))
+        {
+                nregion = base;
+                return -1;
+        }
+        return 0;
+}
+
+typedef struct heap_scan {
+        unsigned long heap_start;       /* [heap] of the main arena           */
+        unsigned long heap_end;
+        HEAP_INFO *heap[MAX_ARENA];     /* HEAP_MAX_SIZE aligned candidates   */
+        unsigned long heap_len[MAX_ARENA];
+        int nheap;
+} HEAP_SCAN;
+
+/*
+ * mmapped chunks sit at the start of their own mapping, possibly shifted by
+ * prev_size to align the user pointer, and cover the mapping to the byte.
+ * Adjacent anonymous mappings are merged in maps, so keep looking past one.
+ */
+void scan_mmapped_chunks(MAP *m)
+{
+        unsigned long pos = m->start, len;
+        CHUNK *c;
+
+        while(pos + MALLOC_ALIGN + sizeof(CHUNK) <= m->end)
+        {
+                c = (CHUNK*)pos;
+                if(!(c->size & IS_MMAPPED) || c->prev_size)
+                {
+                        c = (CHUNK*)(pos + MALLOC_ALIGN - 2*SIZE_SZ);
+                        if(!(c->size & IS_MMAPPED) || c->prev_size != MALLOC_ALIGN - 2*SIZE_SZ)
+                                return;
+                }
+                len = c->prev_size + chunksize(c);
+                if(len == 0 || (len & (page_size-1)) || pos + len > m->end)
+                        return;
+                if(!add_region(REGION_HEAP, (unsigned long)c, pos + len))
+                        return;
+                pos += len;
+        }
+}
+
+int scan_heap_map(MAP *m, void *arg)
+{
+        HEAP_SCAN *hs = (HEAP_SCAN*)arg;
+        HEAP_INFO *h = (HEAP_INFO*)m->start;
+
+        if(strcmp(m->path, "[heap]") == 0)
+        {
+                if(hs->heap_end != m->start)
+                        hs->heap_start = m->start;
+                hs->heap_end = m->end;
+                return 0;
+        }
+        if(m->inode || m->path[0] || strncmp(m->perms, "rw", 2))
+                return 0;
+        if(!(m->start & (HEAP_MAX_SIZE-1)) && hs->nheap < MAX_ARENA &&
+           h->ar_ptr && h->size <= HEAP_MAX_SIZE && h->size <= m->end - m->start &&
+           h->mprotect_size >= h->size)
+        {
+                hs->heap[hs->nheap] = h;
+                hs->heap_len[hs->nheap] = m->end - m->start;
+                hs->nheap++;
+                return 0;
+        }
+        scan_mmapped_chunks(m);
+        return 0;
+}
+
+int in_heap(HEAP_SCAN *hs, void *p)
+{
+        int i;
+
+        for(i=0;i<hs->nheap;i++)
+                if((char*)p >= (char*)hs->heap[i] && (char*)p < (char*)hs->heap[i] + hs->heap_len[i])
+                        return 1;
+        return 0;
+}
+
+/*
+ * An arena pointer is only followed when the whole malloc_state lies in
+ * one heap segment, or for main_arena in a writable segment of a loaded
+ * object.  Returns 1 for a heap, 2 for an object, 0 when it is neither.
+ */
+int arena_ok(HEAP_SCAN *hs, MSTATE *ar)
+{
+        unsigned long a = (unsigned long)ar, e = a + sizeof(MSTATE);
+        int i;
+
+        if(a & (sizeof(long)-1) || e < a)
+                return 0;
+        for(i=0;i<hs->nheap;i++)
+                if(a >= (unsigned long)hs->heap[i] && e <= (unsigned long)hs->heap[i] + hs->heap_len[i])
+                        return 1;
+        for(i=0;i<nobj_seg;i++)
+                if(a >= obj_seg[i].start && e <= obj_seg[i].end)
+                        return 2;
+        return 0;
+}
+
+/*
+ * Fill region[] with the in-use chunks of the main arena, every per-thread
+ * arena and every mmapped chunk, and arena[] with one entry per heap
+ * segment for the NT_SFRAME_ARENA note.
+ */
+void get_region_heap_chunks(void)
+{
+        static HEAP_SCAN hs;
+        MSTATE *main_arena = NULL, *ar;
+        HEAP_INFO *h;
+        ARENA *d;
+        unsigned long first;
+        int i, n, ok;
+
+        memset(&hs, 0, sizeof(hs));
+        narena = 0;
+        read_maps(0, scan_heap_map, &hs);
+        if(!huge_read)
+                get_huge_ranges();
+
+        /* The arena ring runs through main_arena, the only arena outside a heap */
+        for(i=0;i<hs.nheap && !main_arena;i++)
+        {
+                ar = hs.heap[i]->ar_ptr;
+                if(arena_ok(&hs, ar) != 1)
+                        continue;
+                for(n=0, ar=ar->next; ar && n<MAX_ARENA; n++, ar=ar->next)
+                {
+                        ok = arena_ok(&hs, ar);
+                        if(ok == 2)
+                                main_arena = ar;
+                        if(ok != 1)
+                                break;
+                }
+        }
+
+        for(i=0;i<hs.nheap && narena<MAX_ARENA;i++)
+        {
+                h = hs.heap[i];
+                ar = h->ar_ptr;
+                d = &arena[narena++];
+                memset(d, 0, sizeof(ARENA));
+                d->arena = (unsigned long)ar;
+                d->heap_start = (unsigned long)h;
+                d->heap_end = (unsigned long)h + h->size;
+                if(arena_ok(&hs, ar) == 1 && (unsigned long)ar->top >= d->heap_start &&
+                   (unsigned long)ar->top < d->heap_end)
+                        d->top = (unsigned long)ar->top;
+                if((unsigned long)ar >= d->heap_start && (unsigned long)ar < d->heap_end)
+                        first = chunk_align((unsigned long)(ar + 1));
+                else
+                        first = chunk_align((unsigned long)h + sizeof(HEAP_INFO));
+                add_region(REGION_HEAP, d->heap_start, first);
+                if(walk_heap(d, first) < 0)
+                        add_region(REGION_HEAP, first, d->heap_end);
+        }
+
+        if(hs.heap_end && narena < MAX_ARENA)
+        {
+                d = &arena[narena++];
+                memset(d, 0, sizeof(ARENA));
+                d->arena = (unsigned long)main_arena;
+                d->heap_start = hs.heap_start;
+                d->heap_end = hs.heap_end;
+                if(main_arena && (unsigned long)main_arena->top >= hs.heap_start &&
+                   (unsigned long)main_arena->top < hs.heap_end)
+                        d->top = (unsigned long)main_arena->top;
+                if(walk_heap(d, chunk_align(hs.heap_start)) < 0)
+                        add_region(REGION_HEAP, hs.heap_start, hs.heap_end);
+        }
+        for(i=0;i<nhuge;i++)
+                dump_log("[ HUGE  ] %lx-%lx page:%lu\n", huge[i].start, huge[i].end, huge[i].size);
+        for(i=0;i<narena;i++)
+                dump_log("[ ARENA ] %lx heap:%lx-%lx inuse:%lu free:%lu\n", arena[i].arena,
+                       arena[i].heap_start, arena[i].heap_end, arena[i].inuse, arena[i].free);
+}
+
 /*extern char *malloc_begin;*/
 /*extern char *malloc_end;*/
 
@@ -560,57 +2085,675 @@ int testvar=0xDEADBEAF;
 void get_region_all(REGION *r)
 {
 
-        get_region ( &region[REGION_HEAP], "heap");
-        get_region ( &region[REGION_STACK], "stack");
-        get_region_data( &region[REGION_DATA]);
-        get_region_bss( &region[REGION_BSS]);
+        nregion = 0;
+        get_region ( &r[nregion++], "stack");
+        r[nregion-1].type = REGION_STACK;
+        /* Before the heap, which may take every slot but the reserve */
+        get_region_objects();
+        if(heap_dump_mode == HEAP_DUMP_CHUNKS)
+        {
+                get_region_heap_chunks();
+        }
+        else
+        {
+                narena = 0;
+                get_region ( &r[nregion++], "heap");
+                r[nregion-1].type = REGION_HEAP;
+        }
 }
-void dump_core_self(char *filename)
+
+/*
+ * Write the core for r[] to filename through the double-buffered writer.
+ * Returns -1 if the file could not be opened or written.
+ */
+int write_core(char *filename, THREAD_SLOT *slot, int nslot, REGION *r, int count)
 {
-        FRAME (f);
+        static WRITER w;
+        PTIMER t;
 
-        /*int *p=NULL; *p=NULL;*/
+        phase_start(&t);
+        if(writer_open(&w, filename) < 0)
+        {
+                perror("Invalid handle");
+                return -1;
+        }
+        phase_end(&t, DUMP_PHASE_OPEN, -1, 0);
 
+        dump_core(&w, slot, nslot, r, count);
+
+        if(writer_close(&w) < 0)
+        {
+                perror("Could not write the core file");
+                return -1;
+        }
+        printf("Core file %s created successfully!\n", filename);
+        return 0;
+}
+
+
+/*
+ * Out-of-process dump helper.
+ *
+ * dump_helper_start() forks a helper at startup, connected over a
+ * socketpair and sharing a DUMP_CTRL area that holds the region table
+ * computed while the process was healthy.  On a crash dump_core_self()
+ * only stores the registers, brings the object segments up to date (and,
+ * in chunk mode, walks the malloc arenas), sends one byte and blocks.
+ * The helper stops the target, refreshes the [stack]/[heap] extents from
+ * /proc/<pid>/maps, pulls memory with vectored process_vm_readv() calls,
+ * writes the core, resumes the target and acks.  All file I/O happens in
+ * the helper.
+ */
+#define DUMP_IDLE       0
+#define DUMP_REQUEST    1
+#define DUMP_DONE       2
+#define DUMP_FAILED     3
+
+typedef struct dump_ctrl {
+        volatile int   state;         /* DUMP_IDLE/REQUEST/DONE/FAILED       */
+        int            pid;           /* Target process                      */
+        int            nslot;
+        THREAD_SLOT    slot[MAX_THREAD];  /* Crashing threads, dumper first  */
+        char           filename[PATH_MAX];
+        int            heap_dump_mode;
+        int            nregion;
+        int            narena;
+        REGION         region[MAX_REGION];
+        ARENA          arena[MAX_ARENA];
+        int            flight_niov;
+        struct iovec   flight_iov[FLIGHT_IOV];  /* Rings in the target     */
+        int            nobj_id;
+        OBJ_ID         obj_id[MAX_OBJ];
+        DUMP_STATS     stats;         /* Helper side of the last dump only   */
+} DUMP_CTRL;
+
+DUMP_CTRL *dump_ctrl;
+int dump_helper_fd = -1;
+int dump_helper_pid;
+
+int capture_remote(struct iovec *local, struct iovec *remote, int n)
+{
+        ssize_t got;
+        size_t len;
+        int i;
+
+        while(n > 0)
+        {
+                got = process_vm_readv(capture_pid, local, n, remote, n, 0);
+                if(got < 0)
+                        got = 0;
+                /* Skip whole iovecs that were read, zero the one that faulted */
+                for(i=0;i<n && (size_t)got >= local[i].iov_len;i++)
+                        got -= local[i].iov_len;
+                if(i == n)
+                        break;
+                len = local[i].iov_len - got;
+                memset((char*)local[i].iov_base + got, 0, len);
+                local += i+1;
+                remote += i+1;
+                n -= i+1;
+        }
+        return 0;
+}
+
+int refresh_map(MAP *m, void *arg)
+{
+        DUMP_CTRL *c = (DUMP_CTRL*)arg;
+        REGION_TYPE type;
+        int i;
+
+        if(strcmp(m->path, "[stack]") == 0)
+                type = REGION_STACK;
+        else if(strcmp(m->path, "[heap]") == 0 && c->heap_dump_mode == HEAP_DUMP_MAPS)
+                type = REGION_HEAP;
+        else
+                return 0;
+        for(i=0;i<c->nregion;i++)
+                if(c->region[i].type == type)
+                {
+                        if(c->region[i].end != m->start)
+                                c->region[i].start = m->start;
+                        c->region[i].end = m->end;
+                        c->region[i].size = m->end - c->region[i].start;
+                }
+        return 0;
+}
+
+/* 1 if the task's stat shows it stopped, or gone */
+int task_stopped(int pid, char *tid)
+{
+        char path[64], buf[256], *p;
+        int fd, n;
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", pid, tid);
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return 1;
+        n = read(fd, buf, sizeof(buf)-1);
+        close(fd);
+        buf[n > 0 ? n : 0] = 0;
+        p = strrchr(buf, ')');
+        return !p || p[1] != ' ' || strchr("TtZX", p[2]);
+}
+
+/*
+ * Wait (up to ~100ms) for every thread of pid to reach the stopped state.
+ * SIGSTOP stops the group one thread at a time, and one still running
+ * would change its stack and the heap under process_vm_readv().
+ */
+void wait_stopped(int pid)
+{
+        struct dirent *d;
+        char path[64];
+        int tries, running;
+        DIR *dir;
+
+        snprintf(path, sizeof(path), "/proc/%d/task", pid);
+        for(tries=0;tries<100;tries++)
+        {
+                dir = opendir(path);
+                if(!dir)
+                        return;
+                running = 0;
+                while(!running && (d = readdir(dir)))
+                        if(d->d_name[0] != '.' && !task_stopped(pid, d->d_name))
+                                running = 1;
+                closedir(dir);
+                if(!running)
+                        return;
+                usleep(1000);
+        }
+}
+
+void dump_helper_main(int fd)
+{
+        DUMP_CTRL *c = dump_ctrl;
+        PTIMER t;
+        char cmd;
+        int ok;
+
+        prctl(PR_SET_PDEATHSIG, SIGKILL, 0L, 0L, 0L);
+        prctl(PR_SET_NAME, "dump-helper", 0L, 0L, 0L);
+        capture = capture_remote;
+        /* The parent's staging area is MADV_DONTFORK, set up our own now */
+        stage_buf = NULL;
+        dump_stage_init();
+        while(read(fd, &cmd, 1) == 1)
+        {
+                if(c->state != DUMP_REQUEST)
+                        continue;
+                capture_pid = c->pid;
+                kill(c->pid, SIGSTOP);
+                wait_stopped(c->pid);
+
+                memset(&dump_stats, 0, sizeof(dump_stats));
+                phase_start(&t);
+                read_maps(c->pid, refresh_map, c);
+                memcpy(arena, c->arena, c->narena * sizeof(ARENA));
+                narena = c->narena;
+                memcpy(flight_iov, c->flight_iov, c->flight_niov * sizeof(struct iovec));
+                flight_niov = c->flight_niov;
+                memcpy(obj_id, c->obj_id, c->nobj_id * sizeof(OBJ_ID));
+                nobj_id = c->nobj_id;
+                phase_end(&t, DUMP_PHASE_DISCOVER, -1, 0);
+                ok = write_core(c->filename, c->slot, c->nslot, c->region, c->nregion) == 0;
+                c->stats = dump_stats;
+                fflush(stdout);
+
+                /* Resume and answer even if the core could not be written */
+                kill(c->pid, SIGCONT);
+                c->state = ok ? DUMP_DONE : DUMP_FAILED;
+                write(fd, &cmd, 1);
+        }
+        _exit(0);
+}
+
+/* Re-read the region table into the control area, e.g. after dlopen() */
+void dump_helper_refresh(void)
+{
+        if(!dump_ctrl)
+                return;
+        if(heap_dump_mode == HEAP_DUMP_CHUNKS)
+                dump_huge_refresh();
         get_region_all(region);
-        /*printf("Start:%x, End:%x, size:%d\n", start, end, end-start);*/
+        dump_ctrl->heap_dump_mode = heap_dump_mode;
+        dump_ctrl->nregion = nregion;
+        memcpy(dump_ctrl->region, region, nregion * sizeof(REGION));
+        dump_ctrl->narena = narena;
+        memcpy(dump_ctrl->arena, arena, narena * sizeof(ARENA));
+        dump_ctrl->nobj_id = nobj_id;
+        memcpy(dump_ctrl->obj_id, obj_id, nobj_id * sizeof(OBJ_ID));
+}
 
-        int handle = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if(handle <0)
+int dump_helper_start(void)
+{
+        int sv[2];
+
+        dump_ctrl = mmap(NULL, ALIGN(sizeof(DUMP_CTRL), page_size), PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if(dump_ctrl == MAP_FAILED)
         {
-                perror("Invalid handle");
-                exit(0);
+                perror("dump helper mmap failed");
+                dump_ctrl = NULL;
+                return -1;
         }
-        lseek(handle, CORE_SIZE-1, SEEK_SET);
-        write(handle, "", 1);
-        lseek(handle, 0, SEEK_SET);
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        {
+                perror("dump helper socketpair failed");
+                munmap(dump_ctrl, ALIGN(sizeof(DUMP_CTRL), page_size));
+                dump_ctrl = NULL;
+                return -1;
+        }
+        dump_ctrl->pid = getpid();
+        dump_helper_refresh();
+        fflush(stdout);
 
-        char *memblock = NULL;
-        memblock = mmap(NULL, CORE_SIZE, PROT_WRITE|PROT_READ, MAP_SHARED, handle, 0);
+        dump_helper_pid = fork();
+        if(dump_helper_pid < 0)
+        {
+                perror("dump helper fork failed");
+                close(sv[0]);
+                close(sv[1]);
+                munmap(dump_ctrl, ALIGN(sizeof(DUMP_CTRL), page_size));
+                dump_ctrl = NULL;
+                return -1;
+        }
+        if(dump_helper_pid == 0)
+        {
+                close(sv[0]);
+                dump_helper_main(sv[1]);
+        }
+        close(sv[1]);
+        dump_helper_fd = sv[0];
+        /* Yama only lets ancestors read us unless we name the helper */
+        prctl(PR_SET_PTRACER, dump_helper_pid, 0L, 0L, 0L);
+        return 0;
+}
 
-        if (memblock == MAP_FAILED)
+void stats_add(DUMP_COUNTER *to, DUMP_COUNTER *from)
+{
+        to->ns += from->ns;
+        to->cycles += from->cycles;
+        to->bytes += from->bytes;
+        to->count += from->count;
+}
+
+/*
+ * Hand the dump to the helper; returns -1 if it is gone or could not
+ * write the core.  The target is resumed either way.
+ */
+int dump_helper_request(char *filename, THREAD_SLOT *slot, int nslot)
+{
+        DUMP_CTRL *c = dump_ctrl;
+        char cmd = 'D';
+        PTIMER t;
+        int i, p;
+
+        phase_start(&t);
+        /*
+         * Object segments as of now, not dump_helper_start(): objects may
+         * have been dlopen()ed or dlclose()d since.  get_obj_segments()
+         * only walks them again when the loader's counters moved.  The
+         * helper refreshes the [stack] and maps mode [heap] extents itself.
+         */
+        nregion = 0;
+        for(i=0;i<c->nregion;i++)
+                if(c->region[i].type == REGION_STACK)
+                        region[nregion++] = c->region[i];
+        get_region_objects();
+        if(c->heap_dump_mode == HEAP_DUMP_CHUNKS)
         {
-                perror("mmap failed");
-                exit(0);
+                get_region_heap_chunks();
+                c->narena = narena;
+                memcpy(c->arena, arena, narena * sizeof(ARENA));
         }
+        else
+                for(i=0;i<c->nregion;i++)
+                        if(c->region[i].type == REGION_HEAP)
+                                region[nregion++] = c->region[i];
+        c->nregion = nregion;
+        memcpy(c->region, region, nregion * sizeof(REGION));
+        c->nobj_id = nobj_id;
+        memcpy(c->obj_id, obj_id, nobj_id * sizeof(OBJ_ID));
+        c->nslot = nslot;
+        memcpy(c->slot, slot, nslot * sizeof(THREAD_SLOT));
+        c->flight_niov = flight_niov;
+        memcpy(c->flight_iov, flight_iov, flight_niov * sizeof(struct iovec));
+        strncpy(c->filename, filename, sizeof(c->filename)-1);
+        phase_end(&t, DUMP_PHASE_DISCOVER, -1, 0);
+        c->state = DUMP_REQUEST;
+        if(write(dump_helper_fd, &cmd, 1) != 1 || read(dump_helper_fd, &cmd, 1) != 1)
+                return -1;
+        /* c->stats has only the helper's side, add it to ours */
+        for(p=0;p<DUMP_PHASE_MAX;p++)
+                stats_add(&dump_stats.phase[p], &c->stats.phase[p]);
+        for(p=0;p<REGION_MAX;p++)
+                stats_add(&dump_stats.region[p], &c->stats.region[p]);
+        return c->state == DUMP_DONE ? 0 : -1;
+}
+
+/*
+ * Single-flight gate.  The first thread into dump_core_self() wins a CAS on
+ * dump_owner and writes the one core.  Every caller first claims a free
+ * THREAD_SLOT by swapping its tid in and posts its registers there, so
+ * threads that crash alongside the dumper end up as extra NT_PRSTATUS
+ * notes; they then park until the dump is finished.  The dumper gives
+ * them dump_gather_ns to show up.  Every caller frees its own slot before
+ * returning, so none outlives the call that posted it.  A dumper that
+ * found all slots taken posts into owner_slot instead.  Dumps starting
+ * within dump_cooldown_ns of the previous one are dropped and counted in
+ * dump_suppressed.
+ */
+THREAD_SLOT thread_slot[MAX_THREAD];
+THREAD_SLOT owner_slot;
+volatile int dump_owner;
+volatile unsigned long long dump_last_ns;
+unsigned long long dump_cooldown_ns = 10ULL*1000000000;
+unsigned long long dump_gather_ns = 1000000;
+volatile unsigned long dump_suppressed;
+
+int dump_cooling(void)
+{
+        unsigned long long last = dump_last_ns;
 
+        return last && stats_ns() - last < dump_cooldown_ns;
+}
 
+/* Dumper's slot first, so debuggers take it as the current thread */
+int gather_slots(THREAD_SLOT *out, THREAD_SLOT *self)
+{
+        unsigned long long until = stats_ns() + dump_gather_ns;
+        int i, n = 0;
+
+        while(stats_ns() < until)
+                sched_yield();
+        out[n++] = *self;
+        for(i=0;i<MAX_THREAD && n<MAX_THREAD;i++)
+                if(&thread_slot[i] != self && thread_slot[i].valid)
+                        out[n++] = thread_slot[i];
+        return n;
+}
 
-        /*printf("MMAP:%x, SIZE:%d\n", memblock, CORE_SIZE);*/
-        dump_core(handle, memblock, f.uregs, region);
+/* A free slot with tid swapped in, NULL if all are taken */
+THREAD_SLOT *slot_claim(int tid)
+{
+        int i;
+
+        for(i=0;i<MAX_THREAD;i++)
+                if(!thread_slot[i].tid && __sync_bool_compare_and_swap(&thread_slot[i].tid, 0, tid))
+                        return &thread_slot[i];
+        return NULL;
+}
 
-        // Write it now to disk
-        if (msync(memblock, CORE_SIZE, MS_SYNC) == -1)
+void slot_free(THREAD_SLOT *s)
+{
+        if(!s || s == &owner_slot)
+                return;
+        s->valid = 0;
+        __sync_synchronize();
+        s->tid = 0;
+}
+
+/*
+ * FPU state for the NT_FPREGSET (fnsave, which resets the FPU, hence the
+ * frstor), NT_PRXFPREG (fxsave) and NT_X86_XSTATE (xsave) notes.  The
+ * xsave image covers the XCR0 features that fit XSTATE_MAX, dropping the
+ * highest ones (AMX tiles) first; the mask saved goes into the sw_reserved
+ * bytes, where gdb reads XCR0 from.
+ */
+int xstate_size = -1;
+unsigned long long xstate_mask;
+
+void xstate_init(void)
+{
+        unsigned int eax, ebx, ecx, edx, lo, hi, size;
+        unsigned long long mask;
+        int i;
+
+        xstate_size = 0;
+        if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+                return;
+        __asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+        mask = ((unsigned long long)hi << 32) | lo;
+        while(mask > 3)
         {
-                perror("Could not sync the file to disk");
+                /* Legacy area and xsave header, then each component */
+                size = 576;
+                for(i=2;i<64;i++)
+                {
+                        if(!(mask & (1ULL << i)))
+                                continue;
+                        __cpuid_count(0xd, i, eax, ebx, ecx, edx);
+                        if(ebx + eax > size)
+                                size = ebx + eax;
+                }
+                if(size <= XSTATE_MAX)
+                {
+                        xstate_size = size;
+                        xstate_mask = mask;
+                        return;
+                }
+                mask &= ~(1ULL << (63 - __builtin_clzll(mask)));
         }
-        munmap(memblock, CORE_SIZE);
-        close(handle);
-        printf("Core file %s created successfully!\n", filename);
 }
 
+void fpu_save(THREAD_SLOT *s)
+{
+        if(xstate_size < 0)
+                xstate_init();
+        __asm__ volatile ("fnsave %0\n\tfrstor %0" : "+m" (s->fsave));
+        __asm__ volatile ("fxsave %0" : "=m" (s->fxsave));
+        s->xstate_size = xstate_size;
+        if(xstate_size)
+        {
+                memset(s->xstate, 0, xstate_size);
+                __asm__ volatile ("xsave %0" : "+m" (s->xstate)
+                                  : "a" ((unsigned int)xstate_mask),
+                                    "d" ((unsigned int)(xstate_mask >> 32)));
+                memcpy(&s->xstate[XSTATE_XCR0], &xstate_mask, sizeof(xstate_mask));
+        }
+}
+
+/* Signal for the next dump_core_self() on this thread, see dump_core_signal() */
+__thread siginfo_t *dump_siginfo;
+/* Slot to put first instead of our own, see dump_core_context() */
+__thread THREAD_SLOT *dump_for;
+
+/* Fill s with the caller's registers, FPU state and signal */
+void slot_post(THREAD_SLOT *s, int tid, REGS *regs, siginfo_t *si)
+{
+        s->tid = tid;
+        s->regs = *regs;
+        fpu_save(s);
+        if(si)
+                s->info = *si;
+        else
+        {
+                /* Not dumping for a signal: describe it as an abort() */
+                memset(&s->info, 0, sizeof(siginfo_t));
+                s->info.si_signo = SIGABRT;
+                s->info.si_code = SI_TKILL;
+                s->info.si_pid = getpid();
+                s->info.si_uid = getuid();
+        }
+        __sync_synchronize();
+        s->valid = 1;
+}
+
+void dump_core_self(char *filename)
+{
+        FRAME (f);
+        static THREAD_SLOT slot[MAX_THREAD];
+        unsigned long long start = stats_ns();
+        int tid = syscall(SYS_gettid);
+        siginfo_t *si = dump_siginfo;
+        THREAD_SLOT *self;
+        int nslot;
+        PTIMER t;
+
+        /*int *p=NULL; *p=NULL;*/
+        dump_siginfo = NULL;
+
+        /* A fault inside our own dump must not wait for itself */
+        if(dump_owner == tid || dump_cooling())
+        {
+                __sync_fetch_and_add(&dump_suppressed, 1);
+                return;
+        }
+        self = slot_claim(tid);
+        if(self)
+                slot_post(self, tid, &f.uregs, si);
+        if(!__sync_bool_compare_and_swap(&dump_owner, 0, tid))
+        {
+                while(dump_owner)
+                        usleep(1000);
+                slot_free(self);
+                return;
+        }
+        if(dump_cooling())
+        {
+                __sync_fetch_and_add(&dump_suppressed, 1);
+                goto out;
+        }
+        if(!self)
+        {
+                self = &owner_slot;
+                slot_post(self, tid, &f.uregs, si);
+        }
+
+        memset(&dump_stats, 0, sizeof(dump_stats));
+        nslot = gather_slots(slot, dump_for ? dump_for : self);
+        flight_niov = flight_rings ? flight_rings(flight_iov, FLIGHT_IOV) : 0;
+        if(dump_helper_fd >= 0 && dump_helper_request(filename, slot, nslot) == 0)
+        {
+                dump_stats.total_ns = stats_ns() - start;
+                dump_last_ns = stats_ns();
+                goto out;
+        }
+
+        phase_start(&t);
+        get_region_all(region);
+        phase_end(&t, DUMP_PHASE_DISCOVER, -1, 0);
+        /*printf("Start:%x, End:%x, size:%d\n", start, end, end-start);*/
+        write_core(filename, slot, nslot, region, nregion);
+        dump_stats.total_ns = stats_ns() - start;
+        dump_last_ns = stats_ns();
+out:
+        slot_free(self);
+        __sync_synchronize();
+        dump_owner = 0;
+}
+
+/* dump_core_self() for a signal handler; the core records info */
+void dump_core_signal(char *filename, siginfo_t *info)
+{
+        dump_siginfo = info;
+        dump_core_self(filename);
+}
+
+/*
+ * Registers and FPU state of a thread from the context its signal
+ * handler was given.  An i386 FXSR signal frame has the fxsave image
+ * right after the 112 byte legacy part, flagged by a zero magic.
+ */
+#ifdef __x86_64__
+#define UC_REG(uc, r)   ((unsigned int)(uc)->uc_mcontext.gregs[REG_R##r])
+#else
+#define UC_REG(uc, r)   ((unsigned int)(uc)->uc_mcontext.gregs[REG_E##r])
+#endif
+
+void slot_context(THREAD_SLOT *s, int tid, ucontext_t *uc, siginfo_t *info)
+{
+        REGS *r = &s->regs;
+
+        memset(r, 0, sizeof(REGS));
+        r->eax = UC_REG(uc, AX);
+        r->ebx = UC_REG(uc, BX);
+        r->ecx = UC_REG(uc, CX);
+        r->edx = UC_REG(uc, DX);
+        r->esi = UC_REG(uc, SI);
+        r->edi = UC_REG(uc, DI);
+        r->ebp = UC_REG(uc, BP);
+        r->esp = UC_REG(uc, SP);
+        r->eip = UC_REG(uc, IP);
+        r->eflags = uc->uc_mcontext.gregs[REG_EFL];
+        r->orig_eax = -1;
+#ifndef __x86_64__
+        r->cs = uc->uc_mcontext.gregs[REG_CS];
+        r->ss = uc->uc_mcontext.gregs[REG_SS];
+        r->ds = uc->uc_mcontext.gregs[REG_DS];
+        r->es = uc->uc_mcontext.gregs[REG_ES];
+        r->fs = uc->uc_mcontext.gregs[REG_FS];
+        r->gs = uc->uc_mcontext.gregs[REG_GS];
+#endif
+        memset(s->fsave, 0, FSAVE_SIZE);
+        memset(s->fxsave, 0, FXSAVE_SIZE);
+        s->xstate_size = 0;
+        if(uc->uc_mcontext.fpregs)
+        {
+#ifdef __x86_64__
+                memcpy(s->fxsave, uc->uc_mcontext.fpregs, FXSAVE_SIZE);
+#else
+                memcpy(s->fsave, uc->uc_mcontext.fpregs, FSAVE_SIZE);
+                if(!(uc->uc_mcontext.fpregs->status >> 16))
+                        memcpy(s->fxsave, (char*)uc->uc_mcontext.fpregs + 112, FXSAVE_SIZE);
+#endif
+        }
+        s->info = *info;
+        s->tid = tid;
+        __sync_synchronize();
+        s->valid = 1;
+}
+
+/*
+ * dump_core_self() on behalf of thread tid, whose context uc and info
+ * were saved by its signal handler: it goes into the core first, as the
+ * current thread, followed by the caller.  Lets a supervising thread
+ * write the core instead of doing it inside the handler, where malloc,
+ * stdio and pthread_create are off limits.
+ */
+void dump_core_context(char *filename, int tid, ucontext_t *uc, siginfo_t *info)
+{
+        THREAD_SLOT *s = slot_claim(tid);
+
+        if(s)
+                slot_context(s, tid, uc, info);
+        dump_for = s;
+        dump_core_self(filename);
+        dump_for = NULL;
+        slot_free(s);
+}
+
+#ifndef SEGMENT_NO_MAIN
 int main(int argc, char *argv[])
 {
         /*printf("HEAP: start:%x, end:%x\n", malloc_begin, malloc_end);*/
+        int i;
+
+        for(i=1;i<argc;i++)
+        {
+                if(strcmp(argv[i], "-chunks") == 0)
+                        heap_dump_mode = HEAP_DUMP_CHUNKS;
+                else if(strcmp(argv[i], "-helper") == 0)
+                        dump_helper_start();
+                else if(strcmp(argv[i], "-trace") == 0)
+                        dump_trace = 1;
+                else if(strcmp(argv[i], "-j") == 0 && i+1 < argc)
+                        dump_copy_init(atoi(argv[++i]));
+                else if(strcmp(argv[i], "-direct") == 0)
+                        dump_io = DUMP_IO_DIRECT;
+                else if(strcmp(argv[i], "-cached") == 0)
+                        dump_io = DUMP_IO_CACHED;
+                else if(strcmp(argv[i], "-nosync") == 0)
+                        dump_sync = DUMP_SYNC_NONE;
+                else if(strcmp(argv[i], "-fsync") == 0)
+                        dump_sync = DUMP_SYNC_FULL;
+                else if(strcmp(argv[i], "-nohuge") == 0)
+                        dump_hugepages = DUMP_HUGE_NONE;
+                else if(strcmp(argv[i], "-hugetlb") == 0)
+                        dump_hugepages = DUMP_HUGE_HUGETLB;
+        }
         dump_core_self("core.file");
-        printf("DATA END:%x\n", sbrk(0));
+        printf("DATA END:%p\n", sbrk(0));
 }
+#endif
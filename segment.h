@@ -0,0 +1,94 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <signal.h>
+#include <ucontext.h>
+
+/*
+ * Public interface of the self core dumper in segment.c.  Build segment.c
+ * with -DSEGMENT_NO_MAIN to link it into another program.
+ */
+
+/*
+ * Heap dump modes.  REGION_HEAP in maps mode is the [heap] line of
+ * /proc/self/maps, copied whole.  In chunk mode the glibc arenas are walked
+ * and only allocated chunks end up in the core, one PT_LOAD per run of
+ * in-use chunks; free chunks bigger than HEAP_SKIP_MIN and the slack of
+ * every top chunk are left out.
+ */
+#define HEAP_DUMP_MAPS   0
+#define HEAP_DUMP_CHUNKS 1
+
+typedef enum
+{
+        REGION_CODE,
+        REGION_DATA,
+        REGION_BSS,
+        REGION_STACK,
+        REGION_HEAP,
+        REGION_MAX
+}REGION_TYPE;
+
+/*
+ * Per-phase counters of the last dump_core_self().  The copy phase is
+ * also split by region type.  With the dump helper the open/copy/sync/
+ * close phases are measured in the helper and copied back.
+ */
+#define DUMP_PHASE_DISCOVER 0   /* region discovery, heap walk               */
+#define DUMP_PHASE_NOTES    1   /* ELF header and note construction          */
+#define DUMP_PHASE_OPEN     2   /* create the core file, writer buffers      */
+#define DUMP_PHASE_COPY     3   /* memory capture into the writer buffers    */
+#define DUMP_PHASE_WRITE    4   /* waiting for the writer thread             */
+#define DUMP_PHASE_SYNC     5   /* dump_sync flush                           */
+#define DUMP_PHASE_CLOSE    6   /* release buffers, close                    */
+#define DUMP_PHASE_MAX      7
+
+typedef struct dump_counter {
+        unsigned long long ns;
+        unsigned long long cycles;
+        unsigned long long bytes;
+        unsigned long      count;
+} DUMP_COUNTER;
+
+typedef struct dump_stats {
+        DUMP_COUNTER       phase[DUMP_PHASE_MAX];
+        DUMP_COUNTER       region[REGION_MAX];
+        unsigned long long total_ns;
+} DUMP_STATS;
+
+/* How the core reaches the file, and what is flushed before returning */
+#define DUMP_IO_CACHED      0   /* page cache writes                         */
+#define DUMP_IO_DROPBEHIND  1   /* sync_file_range + POSIX_FADV_DONTNEED     */
+#define DUMP_IO_DIRECT      2   /* O_DIRECT                                  */
+
+#define DUMP_SYNC_NONE      0
+#define DUMP_SYNC_DATA      1   /* fdatasync                                 */
+#define DUMP_SYNC_FULL      2   /* fsync of the file and its directory       */
+
+/* Backing of the writer's staging buffers, falling back down the list */
+#define DUMP_HUGE_NONE      0   /* base pages                                */
+#define DUMP_HUGE_THP       1   /* MADV_HUGEPAGE, huge page aligned          */
+#define DUMP_HUGE_HUGETLB   2   /* MAP_HUGETLB from the reserved pool        */
+
+extern unsigned long page_size;                /* sysconf(_SC_PAGESIZE)       */
+extern unsigned long long dump_cooldown_ns;    /* min gap between two dumps   */
+extern unsigned long long dump_gather_ns;      /* wait for other crashers     */
+extern volatile unsigned long dump_suppressed; /* dumps dropped by the gate   */
+extern int dump_io;
+extern int dump_sync;
+extern int dump_hugepages;
+extern DUMP_STATS dump_stats;
+extern int dump_trace;                  /* phase timings, regions on stderr  */
+extern int heap_dump_mode;
+extern int dump_helper_pid;
+
+void dump_core_self(char *filename);
+void dump_core_signal(char *filename, siginfo_t *info);
+void dump_core_context(char *filename, int tid, ucontext_t *uc, siginfo_t *info);
+int  dump_copy_init(int nworkers);
+int  dump_stage_init(void);
+int  dump_helper_start(void);
+void dump_helper_refresh(void);
+void dump_huge_refresh(void);
+
+#endif
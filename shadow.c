@@ -0,0 +1,495 @@
+/*
+ * Shadow stack tracing.
+ *
+ * Linked into a program built with -finstrument-functions, the compiler
+ * calls __cyg_profile_func_enter()/exit() around every function.  Each
+ * thread keeps its own shadow stack of (function, call site) pairs, so
+ * shadow_capture() is a copy instead of a walk of the EBP chain, and
+ * appends a SHADOW_REC per enter and exit to its own trace file.
+ *
+ * The file is written through a SHADOW_WINDOW sized MAP_SHARED window:
+ * a record is two stores and a pointer bump, and only every
+ * SHADOW_WINDOW / sizeof(SHADOW_REC) records does the thread map the
+ * next window.  Nothing is shared between threads, so there are no locks
+ * or atomics on the hot path; the kernel writes the pages back.
+ *
+ * A thread's file is closed by its pthread key destructor, the rest by
+ * shadow_stop(), which also runs at exit.  longjmp() and exceptions skip
+ * exit hooks: the next enter from higher up the stack logs the missing
+ * exits, a later exit pops the shadow stack back to its function and
+ * shadowtree does the same with the records.
+ *
+ *   gcc -m32 -O2 -c shadow.c
+ *   gcc -m32 -O2 -fno-omit-frame-pointer -finstrument-functions \
+ *       app.c shadow.o -o app -lpthread
+ *   SHADOW_DIR=/tmp/trace ./app
+ *   shadowtree /tmp/trace/shadow.<pid>.*
+ *
+ * shadow.c itself must not be built with -finstrument-functions.  The
+ * application needs its frame pointers, see shadow_ret().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "shadow.h"
+
+#define SHADOW_WINDOW   (4*1024*1024)
+#define SHADOW_THREADS  1024
+#define SHADOW_SCAN     64            /* Words searched for a return address */
+
+#define NOTRACE __attribute__((no_instrument_function))
+
+typedef struct shadow_thread {
+        int            fd;
+        volatile int   closed;
+        SHADOW_FILE    hdr;
+        SHADOW_REC    *map;           /* Current window, NULL if none        */
+        SHADOW_REC    *pos, *end;
+        unsigned long long off;       /* File offset of the (next) window    */
+        int            depth;         /* May exceed SHADOW_DEPTH             */
+        unsigned long  fn[SHADOW_DEPTH];
+        unsigned long  site[SHADOW_DEPTH];
+        unsigned long  ret[SHADOW_DEPTH];  /* Return address slot, 0: unknown */
+        unsigned long  stack_hi;      /* Top of the thread's stack           */
+} SHADOW_THREAD;
+
+SHADOW_THREAD *shadow_thread[SHADOW_THREADS];
+volatile int shadow_nthread;
+volatile int shadow_stopped;
+__thread SHADOW_THREAD *shadow_self;
+__thread int shadow_busy;
+pthread_key_t shadow_key;
+pthread_once_t shadow_once = PTHREAD_ONCE_INIT;
+
+NOTRACE unsigned long long shadow_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+NOTRACE const char *shadow_dir(void)
+{
+        const char *dir = getenv("SHADOW_DIR");
+
+        return dir ? dir : ".";
+}
+
+/*
+ * Map the window after the current one, growing the file first.  If
+ * that fails, t->off stays at the unmapped window and the next record
+ * tries again.
+ */
+NOTRACE int shadow_window(SHADOW_THREAD *t)
+{
+        void *m;
+
+        if(t->map)
+        {
+                munmap(t->map, SHADOW_WINDOW);
+                t->off += SHADOW_WINDOW;
+        }
+        t->map = t->pos = t->end = NULL;
+        if(ftruncate(t->fd, t->off + SHADOW_WINDOW) < 0)
+                return -1;
+        m = mmap(NULL, SHADOW_WINDOW, PROT_READ|PROT_WRITE, MAP_SHARED, t->fd, t->off);
+        if(m == MAP_FAILED)
+                return -1;
+        t->map = t->pos = m;
+        t->end = t->map + SHADOW_WINDOW / sizeof(SHADOW_REC);
+        return 0;
+}
+
+NOTRACE unsigned long long shadow_count(SHADOW_THREAD *t)
+{
+        return (t->off - SHADOW_HDR_SIZE) / sizeof(SHADOW_REC) + (t->map ? t->pos - t->map : 0);
+}
+
+/* Written at the start too, so shadowtree can read a crashed trace */
+__attribute__((noinline)) NOTRACE
+void shadow_header(SHADOW_THREAD *t)
+{
+        pwrite(t->fd, &t->hdr, sizeof(t->hdr), 0);
+}
+
+/*
+ * Write the final header.  Only the owner, or everyone once stopped,
+ * may unmap and trim; another thread's window is left alone as it may
+ * still be writing the record it started before shadow_stop().
+ */
+NOTRACE void shadow_close(SHADOW_THREAD *t, int own)
+{
+        if(!__sync_bool_compare_and_swap(&t->closed, 0, 1))
+                return;
+        t->hdr.count = shadow_count(t);
+        t->hdr.tsc1 = __builtin_ia32_rdtsc();
+        t->hdr.ns1 = shadow_ns();
+        shadow_header(t);
+        if(own)
+        {
+                if(t->map)
+                        munmap(t->map, SHADOW_WINDOW);
+                t->map = t->pos = t->end = NULL;
+                ftruncate(t->fd, SHADOW_HDR_SIZE + t->hdr.count * sizeof(SHADOW_REC));
+                close(t->fd);
+        }
+}
+
+NOTRACE void shadow_exit(void *arg)
+{
+        SHADOW_THREAD *t = arg;
+
+        shadow_self = NULL;
+        shadow_close(t, 1);
+}
+
+/* A forked child traces into files of its own */
+NOTRACE void shadow_child(void)
+{
+        shadow_self = NULL;
+        shadow_nthread = 0;
+}
+
+NOTRACE void shadow_init(void)
+{
+        pthread_key_create(&shadow_key, shadow_exit);
+        pthread_atfork(NULL, NULL, shadow_child);
+}
+
+NOTRACE SHADOW_THREAD *shadow_attach(void)
+{
+        SHADOW_THREAD *t;
+        pthread_attr_t attr;
+        char path[4096];
+        size_t size;
+        void *lo;
+        int i;
+
+        pthread_once(&shadow_once, shadow_init);
+        i = __sync_fetch_and_add(&shadow_nthread, 1);
+        if(i >= SHADOW_THREADS)
+                return NULL;
+        t = mmap(NULL, sizeof(SHADOW_THREAD), PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(t == MAP_FAILED)
+                return NULL;
+        t->hdr.magic = SHADOW_MAGIC;
+        t->hdr.version = SHADOW_VERSION;
+        t->hdr.pid = getpid();
+        t->hdr.tid = syscall(SYS_gettid);
+        prctl(PR_GET_NAME, t->hdr.name, 0L, 0L, 0L);
+        snprintf(path, sizeof(path), "%s/shadow.%d.%d", shadow_dir(), t->hdr.pid, t->hdr.tid);
+        t->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if(t->fd < 0)
+        {
+                perror(path);
+                munmap(t, sizeof(SHADOW_THREAD));
+                return NULL;
+        }
+        t->stack_hi = ~0UL;
+        if(!pthread_getattr_np(pthread_self(), &attr))
+        {
+                if(!pthread_attr_getstack(&attr, &lo, &size))
+                        t->stack_hi = (unsigned long)lo + size;
+                pthread_attr_destroy(&attr);
+        }
+        t->hdr.tsc0 = __builtin_ia32_rdtsc();
+        t->hdr.ns0 = shadow_ns();
+        shadow_header(t);
+        t->off = SHADOW_HDR_SIZE;
+        shadow_window(t);
+        shadow_thread[i] = t;
+        pthread_setspecific(shadow_key, t);
+        return t;
+}
+
+static inline NOTRACE SHADOW_THREAD *shadow_get(void)
+{
+        SHADOW_THREAD *t = shadow_self;
+
+        if(t || shadow_stopped || shadow_busy)
+                return t;
+        /* Attaching calls into libc, which may itself be instrumented */
+        shadow_busy = 1;
+        t = shadow_self = shadow_attach();
+        shadow_busy = 0;
+        return t;
+}
+
+/*
+ * The stack slot holding fn's return address, 0 if it is not found.
+ * Unlike the hook's own frame address it does not depend on the size of
+ * fn's frame, so two calls from one frame get the same slot.  A small
+ * frame is searched just above the hook's; past SHADOW_SCAN words the
+ * hook's saved EBP is tried as fn's frame pointer, if it points up this
+ * thread's stack to a return address of site.
+ */
+/* Inlined always: the frame searched from must be the hook's */
+static inline __attribute__((always_inline)) NOTRACE
+unsigned long shadow_ret(SHADOW_THREAD *t, void *site)
+{
+        unsigned long *p = __builtin_frame_address(0), *fp;
+        int i;
+
+        for(i=0;i<SHADOW_SCAN && (unsigned long)&p[i] < t->stack_hi;i++)
+                if(p[i] == (unsigned long)site)
+                        return (unsigned long)&p[i];
+        fp = (unsigned long *)p[0];
+        if(fp > p && (unsigned long)&fp[1] < t->stack_hi && fp[1] == (unsigned long)site)
+                return (unsigned long)&fp[1];
+        return 0;
+}
+
+static inline NOTRACE void shadow_record(SHADOW_THREAD *t, unsigned long long tsc,
+                                        unsigned long fn)
+{
+        if(t->pos == t->end && shadow_window(t) < 0)
+        {
+                t->hdr.dropped++;
+                return;
+        }
+        t->pos->tsc = tsc;
+        t->pos->fn = fn;
+        t->pos++;
+}
+
+NOTRACE void __cyg_profile_func_enter(void *fn, void *site)
+{
+        SHADOW_THREAD *t = shadow_get();
+        unsigned long ret;
+        unsigned long long tsc;
+        int d, keep;
+
+        if(!t || t->closed)
+                return;
+        ret = shadow_ret(t, site);
+        tsc = __builtin_ia32_rdtsc() & ~(unsigned long long)SHADOW_EXIT;
+        /*
+         * A frame whose return address is below ours has returned without
+         * its exit hook: longjmp() went past it.  Log the exit now so the
+         * records stay balanced.  Inlined functions share their caller's
+         * return address, so in the same slot only one that returns
+         * elsewhere is gone.  A frame whose slot was not found (a large
+         * frame without a frame pointer) goes with the nearest frame
+         * under it that has one, as it was called from there; while that
+         * one lives it is kept, and the exit of a caller pops it.
+         */
+        if(ret && t->depth <= SHADOW_DEPTH)
+        {
+                for(keep=d=t->depth;d>0;d--)
+                {
+                        if(!t->ret[d-1])
+                                continue;
+                        if(t->ret[d-1] > ret ||
+                           (t->ret[d-1] == ret && t->site[d-1] == (unsigned long)site))
+                                break;
+                        keep = d - 1;
+                }
+                while(t->depth > keep)
+                {
+                        t->depth--;
+                        shadow_record(t, tsc | SHADOW_EXIT, t->fn[t->depth]);
+                }
+        }
+        if(t->depth < SHADOW_DEPTH)
+        {
+                t->fn[t->depth] = (unsigned long)fn;
+                t->site[t->depth] = (unsigned long)site;
+                t->ret[t->depth] = ret;
+        }
+        t->depth++;
+        shadow_record(t, tsc, (unsigned long)fn);
+}
+
+NOTRACE void __cyg_profile_func_exit(void *fn, void *site)
+{
+        SHADOW_THREAD *t = shadow_self;
+        int d;
+
+        if(!t || t->closed)
+                return;
+        /* Frames skipped by longjmp() never exited, drop them too */
+        for(d=t->depth-1;d>=0 && d<SHADOW_DEPTH && t->fn[d]!=(unsigned long)fn;d--)
+                ;
+        if(d >= 0)
+                t->depth = d;
+        else if(t->depth > 0)
+                t->depth--;
+        shadow_record(t, __builtin_ia32_rdtsc() | SHADOW_EXIT, (unsigned long)fn);
+}
+
+/*
+ * The calling thread's stack from its shadow stack, innermost first and
+ * like stack_capture(): pc[0] is the return into the caller, then the
+ * call site of every traced function still running.
+ */
+__attribute__((noinline)) NOTRACE
+int shadow_capture(unsigned long *pc, int max)
+{
+        SHADOW_THREAD *t = shadow_self;
+        int n = 0, d;
+
+        if(max < 1)
+                return 0;
+        pc[n++] = (unsigned long)__builtin_return_address(0);
+        if(!t)
+                return n;
+        d = t->depth < SHADOW_DEPTH ? t->depth : SHADOW_DEPTH;
+        while(d > 0 && n < max)
+                pc[n++] = t->site[--d];
+        return n;
+}
+
+NOTRACE int shadow_obj(struct dl_phdr_info *info, size_t size, void *arg)
+{
+        const ElfW(Phdr) *ph = info->dlpi_phdr;
+        FILE *f = arg;
+        SHADOW_OBJ o;
+        unsigned long a;
+        int i;
+
+        memset(&o, 0, sizeof(o));
+        o.lo = ~0ULL;
+        o.bias = info->dlpi_addr;
+        for(i=0;i<info->dlpi_phnum;i++)
+        {
+                if(ph[i].p_type == PT_LOAD)
+                {
+                        a = info->dlpi_addr + ph[i].p_vaddr;
+                        if(a < o.lo)
+                                o.lo = a;
+                        if(a + ph[i].p_memsz > o.hi)
+                                o.hi = a + ph[i].p_memsz;
+                }
+                else if(ph[i].p_type == PT_NOTE)
+                {
+                        const char *p = (const char *)(info->dlpi_addr + ph[i].p_vaddr);
+                        const char *end = p + ph[i].p_memsz;
+                        const ElfW(Nhdr) *n;
+
+                        while(p + sizeof(*n) <= end)
+                        {
+                                n = (const ElfW(Nhdr) *)p;
+                                p += sizeof(*n);
+                                if(n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 &&
+                                   !memcmp(p, "GNU", 4) && n->n_descsz <= sizeof(o.id))
+                                {
+                                        o.id_size = n->n_descsz;
+                                        memcpy(o.id, p + 4, n->n_descsz);
+                                }
+                                p += ((n->n_namesz + 3) & ~3) + ((n->n_descsz + 3) & ~3);
+                        }
+                }
+        }
+        if(o.lo >= o.hi)
+                return 0;
+        if(info->dlpi_name && info->dlpi_name[0])
+                strncpy(o.path, info->dlpi_name, sizeof(o.path)-1);
+        else
+                readlink("/proc/self/exe", o.path, sizeof(o.path)-1);
+        fwrite(&o, sizeof(o), 1, f);
+        return 0;
+}
+
+/* Stop tracing: close every thread's file and write the object table */
+__attribute__((destructor)) NOTRACE
+void shadow_stop(void)
+{
+        char path[4096];
+        FILE *f;
+        int i, n;
+
+        if(shadow_stopped || !shadow_nthread)
+                return;
+        shadow_stopped = 1;
+        n = shadow_nthread < SHADOW_THREADS ? shadow_nthread : SHADOW_THREADS;
+        for(i=0;i<n;i++)
+                if(shadow_thread[i])
+                        shadow_close(shadow_thread[i], shadow_thread[i] == shadow_self);
+        snprintf(path, sizeof(path), "%s/shadow.%d.objs", shadow_dir(), getpid());
+        f = fopen(path, "w");
+        if(!f)
+        {
+                perror(path);
+                return;
+        }
+        dl_iterate_phdr(shadow_obj, f);
+        fclose(f);
+}
+
+#ifdef SHADOW_TEST
+/*
+ * Self check, calling the hooks by hand the way -finstrument-functions
+ * would, as shadow.c itself is built without it:
+ *
+ *   gcc -m32 -O2 -fno-omit-frame-pointer -DSHADOW_TEST shadow.c -o shadow_test
+ *
+ * A caller whose frame is too large for SHADOW_SCAN must stay on the
+ * shadow stack across its callees, and frames left by longjmp(), large
+ * or small, must be unwound at the next enter.
+ */
+#include <setjmp.h>
+
+jmp_buf test_jmp;
+int test_errors;
+
+NOTRACE void test_depth(int depth, const char *what)
+{
+        if(shadow_self->depth == depth)
+                return;
+        fprintf(stderr, "shadow: %s: depth %d, expected %d\n", what, shadow_self->depth, depth);
+        test_errors++;
+}
+
+__attribute__((noinline)) NOTRACE void test_leaf(int depth)
+{
+        __cyg_profile_func_enter((void *)test_leaf, __builtin_return_address(0));
+        test_depth(depth, "leaf");
+        __cyg_profile_func_exit((void *)test_leaf, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) NOTRACE void test_big(int jump)
+{
+        volatile char buf[4096];
+
+        __cyg_profile_func_enter((void *)test_big, __builtin_return_address(0));
+        buf[0] = jump;
+        if(buf[0])
+                longjmp(test_jmp, 1);
+        test_leaf(2);
+        test_leaf(2);
+        test_depth(1, "big");
+        __cyg_profile_func_exit((void *)test_big, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) NOTRACE void test_small(void)
+{
+        __cyg_profile_func_enter((void *)test_small, __builtin_return_address(0));
+        test_big(1);
+        __cyg_profile_func_exit((void *)test_small, __builtin_return_address(0));
+}
+
+NOTRACE int main(int argc, char *argv[])
+{
+        test_leaf(1);
+        test_big(0);
+        test_depth(0, "main");
+        if(!setjmp(test_jmp))
+                test_small();
+        test_leaf(1);
+        test_depth(0, "longjmp");
+        shadow_stop();
+        printf("shadow: %s\n", test_errors ? "FAILED" : "ok");
+        return test_errors != 0;
+}
+#endif
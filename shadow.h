@@ -0,0 +1,54 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+
+/*
+ * Function entry/exit tracing for programs built with
+ * -finstrument-functions, see shadow.c.  Every thread writes
+ *
+ *   <dir>/shadow.<pid>.<tid>    SHADOW_FILE, then count SHADOW_RECs
+ *
+ * and the process adds, at exit,
+ *
+ *   <dir>/shadow.<pid>.objs     SHADOW_OBJ per loaded object
+ *
+ * with dir from $SHADOW_DIR, default ".".  shadowtree turns them into
+ * call trees.  All fields are fixed size so a 32-bit trace reads the same
+ * on a 64-bit host.
+ */
+#define SHADOW_MAGIC    0x57444853    /* "SHDW" */
+#define SHADOW_VERSION  1
+#define SHADOW_EXIT     1             /* SHADOW_REC.tsc bit 0                */
+#define SHADOW_DEPTH    256           /* shadow stack entries kept           */
+#define SHADOW_HDR_SIZE 4096          /* records start here in the file      */
+
+typedef struct {
+        uint32_t       magic;
+        uint32_t       version;
+        int32_t        pid;
+        int32_t        tid;
+        char           name[16];
+        uint64_t       count;         /* records in the file                 */
+        uint64_t       dropped;       /* records lost, no window mapped      */
+        uint64_t       tsc0, ns0;     /* at the thread's first record        */
+        uint64_t       tsc1, ns1;     /* when the file was closed            */
+} SHADOW_FILE;
+
+typedef struct {
+        uint64_t       tsc;           /* rdtsc, bit 0 SHADOW_EXIT            */
+        uint64_t       fn;            /* function entered or left            */
+} SHADOW_REC;
+
+typedef struct {
+        uint64_t       lo, hi;        /* Address range of its PT_LOADs       */
+        uint64_t       bias;
+        uint32_t       id_size;
+        uint8_t        id[32];        /* GNU build-id                        */
+        char           path[256];
+} SHADOW_OBJ;
+
+int  shadow_capture(unsigned long *pc, int max);
+void shadow_stop(void);
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * shadowtree - call trees from shadow.c traces.
+ *
+ *   shadowtree [-p percent] [-n rows] [-s symdir] shadow.<pid>.<tid>...
+ *
+ * Replays each thread's enter/exit records against a stack and prints
+ * the exact call tree with calls, inclusive and exclusive time per path,
+ * hiding subtrees under -p percent of the thread (default 0.5), then the
+ * -n (default 30) functions with the most exclusive time.  Recursion is
+ * counted once in a function's flat inclusive time.
+ *
+ * Addresses are named through shadow.<pid>.objs next to the trace and the
+ * symidx index of each object in -s, $SYMIDX_PATH or /var/cache/symidx;
+ * without an index they print as object+offset.  A trace that was never
+ * closed (the process crashed) is read up to its last record.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shadow.h"
+#include "symidx.h"
+
+#define MAX_OBJS        256
+
+typedef struct node {
+        uint64_t       fn;
+        unsigned int   parent;
+        unsigned int   child, next;   /* First child, next sibling, 0: none  */
+        unsigned long long calls;
+        unsigned long long incl, excl;
+} NODE;
+
+typedef struct flat {
+        uint64_t       fn;            /* 0: free                             */
+        unsigned long long calls;
+        unsigned long long incl, excl;
+        unsigned int   active;        /* Frames of it on the stack           */
+} FLAT;
+
+typedef struct frame {
+        unsigned int   node;
+        FLAT          *flat;
+        uint64_t       start;
+        unsigned long long inner;     /* Inclusive time of its callees       */
+} FRAME;
+
+typedef struct obj {
+        SHADOW_OBJ     o;
+        const SFI_HDR *sfi;           /* NULL: no index                      */
+        size_t         sfi_size;
+} OBJ;
+
+NODE *node;
+unsigned int nnode, node_cap;
+unsigned int *node_hash;              /* (parent, fn) -> node                */
+unsigned int node_hash_size;
+
+FLAT *flat;
+unsigned int nflat, flat_size;
+
+FRAME *stack;
+unsigned int depth, stack_cap;
+
+OBJ objs[MAX_OBJS];
+int nobjs, objs_pid = -1;
+
+const char *sym_dir;
+double percent = 0.5;
+int rows = 30;
+double scale;                         /* ms per tsc tick, 0: print cycles    */
+
+unsigned int hash64(uint64_t a, uint64_t b)
+{
+        uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ b * 0xc2b2ae3d27d4eb4fULL;
+
+        return h ^ h >> 29;
+}
+
+void *grow(void *p, unsigned int *cap, size_t size)
+{
+        *cap = *cap ? *cap * 2 : 1024;
+        p = realloc(p, *cap * size);
+        if(!p)
+        {
+                perror("realloc");
+                exit(1);
+        }
+        return p;
+}
+
+void node_rehash(void)
+{
+        unsigned int i, h, mask;
+
+        free(node_hash);
+        node_hash_size = node_hash_size ? node_hash_size * 2 : 4096;
+        node_hash = calloc(node_hash_size, sizeof(*node_hash));
+        mask = node_hash_size - 1;
+        for(i=1;i<nnode;i++)
+        {
+                for(h=hash64(node[i].parent, node[i].fn)&mask;node_hash[h];h=(h+1)&mask)
+                        ;
+                node_hash[h] = i;
+        }
+}
+
+unsigned int node_get(unsigned int parent, uint64_t fn)
+{
+        unsigned int h, mask = node_hash_size - 1;
+        NODE *n;
+
+        for(h=hash64(parent, fn)&mask;node_hash[h];h=(h+1)&mask)
+        {
+                n = &node[node_hash[h]];
+                if(n->parent == parent && n->fn == fn)
+                        return node_hash[h];
+        }
+        if(nnode == node_cap)
+                node = grow(node, &node_cap, sizeof(NODE));
+        n = &node[nnode];
+        memset(n, 0, sizeof(*n));
+        n->fn = fn;
+        n->parent = parent;
+        n->next = node[parent].child;
+        node[parent].child = nnode;
+        node_hash[h] = nnode++;
+        if(nnode * 2 > node_hash_size)
+                node_rehash();
+        return nnode - 1;
+}
+
+FLAT *flat_get(uint64_t fn)
+{
+        unsigned int h, mask, i;
+        FLAT *old;
+
+        if(nflat * 2 >= flat_size)
+        {
+                old = flat;
+                i = flat_size;
+                flat_size = flat_size ? flat_size * 2 : 4096;
+                flat = calloc(flat_size, sizeof(FLAT));
+                mask = flat_size - 1;
+                while(i--)
+                {
+                        if(!old[i].fn)
+                                continue;
+                        for(h=hash64(old[i].fn, 0)&mask;flat[h].fn;h=(h+1)&mask)
+                                ;
+                        flat[h] = old[i];
+                }
+                free(old);
+                /* Frames point into the table */
+                for(i=0;i<depth;i++)
+                        stack[i].flat = flat_get(node[stack[i].node].fn);
+        }
+        mask = flat_size - 1;
+        for(h=hash64(fn, 0)&mask;flat[h].fn;h=(h+1)&mask)
+                if(flat[h].fn == fn)
+                        return &flat[h];
+        flat[h].fn = fn;
+        nflat++;
+        return &flat[h];
+}
+
+void enter(uint64_t fn, uint64_t tsc)
+{
+        unsigned int parent = depth ? stack[depth-1].node : 0;
+        FRAME *f;
+
+        if(depth == stack_cap)
+                stack = grow(stack, &stack_cap, sizeof(FRAME));
+        f = &stack[depth];
+        f->node = node_get(parent, fn);
+        f->start = tsc;
+        f->inner = 0;
+        depth++;
+        f->flat = flat_get(fn);
+        f->flat->active++;
+        f->flat->calls++;
+        node[f->node].calls++;
+}
+
+void leave(uint64_t tsc)
+{
+        FRAME *f = &stack[--depth];
+        unsigned long long t = tsc > f->start ? tsc - f->start : 0;
+
+        node[f->node].incl += t;
+        node[f->node].excl += t > f->inner ? t - f->inner : 0;
+        f->flat->excl += t > f->inner ? t - f->inner : 0;
+        if(!--f->flat->active)
+                f->flat->incl += t;
+        if(depth)
+                stack[depth-1].inner += t;
+}
+
+/* Exits pop back to their function, as longjmp() skipped some */
+void exit_fn(uint64_t fn, uint64_t tsc)
+{
+        unsigned int d;
+
+        for(d=depth;d>0 && node[stack[d-1].node].fn!=fn;d--)
+                ;
+        if(!d)
+                return;
+        while(depth >= d)
+                leave(tsc);
+}
+
+void obj_load(const char *trace, int pid)
+{
+        char path[4096], hex[2 * SFI_ID_MAX + 1], *slash;
+        struct stat st;
+        int fd, i;
+        FILE *f;
+
+        if(pid == objs_pid)
+                return;
+        for(i=0;i<nobjs;i++)
+                if(objs[i].sfi)
+                        munmap((void *)objs[i].sfi, objs[i].sfi_size);
+        nobjs = 0;
+        objs_pid = pid;
+        slash = strrchr(trace, '/');
+        snprintf(path, sizeof(path), "%.*sshadow.%d.objs",
+                 slash ? (int)(slash - trace + 1) : 0, trace, pid);
+        f = fopen(path, "r");
+        if(!f)
+        {
+                perror(path);
+                return;
+        }
+        while(nobjs < MAX_OBJS && fread(&objs[nobjs].o, sizeof(SHADOW_OBJ), 1, f) == 1)
+        {
+                OBJ *o = &objs[nobjs++];
+
+                o->o.path[sizeof(o->o.path)-1] = 0;
+                o->sfi = NULL;
+                if(!o->o.id_size || o->o.id_size > SFI_ID_MAX)
+                        continue;
+                for(i=0;i<(int)o->o.id_size;i++)
+                        snprintf(hex + 2 * i, 3, "%02x", o->o.id[i]);
+                if(snprintf(path, sizeof(path), "%s/%s.sfi", sym_dir, hex) >= (int)sizeof(path))
+                        continue;
+                fd = open(path, O_RDONLY);
+                if(fd < 0)
+                        continue;
+                if(!fstat(fd, &st) && st.st_size >= (off_t)sizeof(SFI_HDR))
+                {
+                        o->sfi = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        o->sfi_size = st.st_size;
+                        if(o->sfi == MAP_FAILED)
+                                o->sfi = NULL;
+                        else if(!sfi_valid(o->sfi, o->sfi_size) ||
+                                o->sfi->id_size != o->o.id_size ||
+                                memcmp(o->sfi->id, o->o.id, o->o.id_size))
+                        {
+                                munmap((void *)o->sfi, o->sfi_size);
+                                o->sfi = NULL;
+                        }
+                }
+                close(fd);
+        }
+        fclose(f);
+}
+
+const char *sym_name(uint64_t fn)
+{
+        static char buf[512];
+        const SFI_FUNC *func;
+        const char *base;
+        uint64_t a;
+        int i, lo, hi, mid;
+
+        for(i=0;i<nobjs;i++)
+        {
+                if(fn < objs[i].o.lo || fn >= objs[i].o.hi)
+                        continue;
+                a = fn - objs[i].o.bias;
+                if(objs[i].sfi)
+                {
+                        func = (const SFI_FUNC *)((const char *)objs[i].sfi + objs[i].sfi->func_off);
+                        lo = 0;
+                        hi = objs[i].sfi->nfunc;
+                        while(lo < hi)
+                        {
+                                mid = (lo + hi) / 2;
+                                if(func[mid].start <= a)
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        if(lo && a < func[lo-1].end)
+                                return sfi_str(objs[i].sfi, func[lo-1].name);
+                }
+                base = strrchr(objs[i].o.path, '/');
+                snprintf(buf, sizeof(buf), "%s+0x%llx", base ? base + 1 : objs[i].o.path,
+                         (unsigned long long)a);
+                return buf;
+        }
+        snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)fn);
+        return buf;
+}
+
+double ms(unsigned long long t)
+{
+        return scale ? t * scale : t / 1e6;
+}
+
+int by_incl(const void *a, const void *b)
+{
+        const NODE *x = &node[*(const unsigned int *)a], *y = &node[*(const unsigned int *)b];
+
+        return x->incl < y->incl ? 1 : x->incl > y->incl ? -1 : 0;
+}
+
+int by_excl(const void *a, const void *b)
+{
+        const FLAT *x = a, *y = b;
+
+        return x->excl < y->excl ? 1 : x->excl > y->excl ? -1 : 0;
+}
+
+void print_tree(unsigned int n, int level, unsigned long long min)
+{
+        unsigned int c, k = 0, *child;
+
+        if(n)
+                printf("%12.3f %12.3f %10llu  %*s%s\n", ms(node[n].incl), ms(node[n].excl),
+                       node[n].calls, 2 * level, "", sym_name(node[n].fn));
+        for(c=node[n].child;c;c=node[c].next)
+                k++;
+        if(!k)
+                return;
+        child = malloc(k * sizeof(*child));
+        k = 0;
+        for(c=node[n].child;c;c=node[c].next)
+                child[k++] = c;
+        qsort(child, k, sizeof(*child), by_incl);
+        for(c=0;c<k && node[child[c]].incl>=min;c++)
+                print_tree(child[c], level + (n != 0), min);
+        free(child);
+}
+
+int trace(const char *path)
+{
+        const SHADOW_FILE *hdr;
+        const SHADOW_REC *rec;
+        unsigned long long count, total, i;
+        uint64_t tsc1;
+        struct stat st;
+        const char *unit;
+        void *m;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+        {
+                perror(path);
+                return -1;
+        }
+        if(fstat(fd, &st) < 0 || st.st_size < SHADOW_HDR_SIZE)
+        {
+                fprintf(stderr, "%s: not a shadow trace\n", path);
+                close(fd);
+                return -1;
+        }
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(m == MAP_FAILED)
+        {
+                perror(path);
+                return -1;
+        }
+        hdr = m;
+        if(hdr->magic != SHADOW_MAGIC || hdr->version != SHADOW_VERSION)
+        {
+                fprintf(stderr, "%s: not a shadow trace\n", path);
+                munmap(m, st.st_size);
+                return -1;
+        }
+        rec = (const SHADOW_REC *)((char *)m + SHADOW_HDR_SIZE);
+        count = (st.st_size - SHADOW_HDR_SIZE) / sizeof(SHADOW_REC);
+        if(hdr->tsc1 && hdr->count < count)
+                count = hdr->count;
+        /* Never closed: the file ends in the zeroes of its last window */
+        while(!hdr->tsc1 && count && !rec[count-1].tsc)
+                count--;
+        tsc1 = hdr->tsc1 ? hdr->tsc1 : count ? rec[count-1].tsc : hdr->tsc0;
+        if(hdr->tsc1 > hdr->tsc0 && hdr->ns1 > hdr->ns0)
+        {
+                scale = (double)(hdr->ns1 - hdr->ns0) / (hdr->tsc1 - hdr->tsc0) / 1e6;
+                unit = "ms";
+        }
+        else
+        {
+                scale = 0;
+                unit = "Mcyc";
+        }
+        obj_load(path, hdr->pid);
+
+        nnode = 1;
+        if(!node_cap)
+                node = grow(node, &node_cap, sizeof(NODE));
+        memset(node, 0, sizeof(NODE));
+        node_hash_size = 0;
+        node_rehash();
+        free(flat);
+        flat = NULL;
+        nflat = flat_size = 0;
+        depth = 0;
+        for(i=0;i<count;i++)
+        {
+                if(rec[i].tsc & SHADOW_EXIT)
+                        exit_fn(rec[i].fn, rec[i].tsc);
+                else
+                        enter(rec[i].fn, rec[i].tsc);
+        }
+        while(depth)
+                leave(tsc1);
+
+        total = 0;
+        for(i=node[0].child;i;i=node[i].next)
+                total += node[i].incl;
+        printf("%s: thread %d \"%.16s\", %llu records, %llu dropped%s, %.3f %s traced\n\n",
+               path, hdr->tid, hdr->name, count, (unsigned long long)hdr->dropped,
+               hdr->tsc1 ? "" : ", not closed", ms(total), unit);
+        printf("%10s %s %10s %s %10s  %s\n", "incl", unit, "excl", unit, "calls", "call tree");
+        print_tree(0, 0, total * percent / 100);
+
+        printf("\n%10s %s %10s %s %10s  %s\n", "excl", unit, "incl", unit, "calls", "function");
+        for(i=0,count=0;i<flat_size;i++)
+                if(flat[i].fn)
+                        flat[count++] = flat[i];
+        qsort(flat, count, sizeof(FLAT), by_excl);
+        for(i=0;i<count && i<(unsigned long long)rows;i++)
+                printf("%12.3f %12.3f %10llu  %s\n", ms(flat[i].excl), ms(flat[i].incl),
+                       flat[i].calls, sym_name(flat[i].fn));
+        printf("\n");
+        munmap(m, st.st_size);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        int opt, i, err = 0;
+
+        sym_dir = getenv("SYMIDX_PATH");
+        if(!sym_dir)
+                sym_dir = "/var/cache/symidx";
+        while((opt = getopt(argc, argv, "p:n:s:")) != -1)
+        {
+                if(opt == 'p')
+                        percent = atof(optarg);
+                else if(opt == 'n')
+                        rows = atoi(optarg);
+                else if(opt == 's')
+                        sym_dir = optarg;
+                else
+                {
+                        fprintf(stderr, "usage: %s [-p percent] [-n rows] [-s symdir] trace...\n", argv[0]);
+                        return 1;
+                }
+        }
+        if(optind >= argc)
+        {
+                fprintf(stderr, "usage: %s [-p percent] [-n rows] [-s symdir] trace...\n", argv[0]);
+                return 1;
+        }
+        for(i=optind;i<argc;i++)
+        {
+                /* Let shadow.<pid>.* name the object table too */
+                if(strlen(argv[i]) > 5 && !strcmp(argv[i] + strlen(argv[i]) - 5, ".objs"))
+                        continue;
+                if(trace(argv[i]) < 0)
+                        err = 1;
+        }
+        return err;
+}
@@ -420,29 +420,401 @@
 */
 
 
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<execinfo.h>
 #include<stdlib.h>
+#include<string.h>
+#include<dlfcn.h>
+#include<pthread.h>
+#include<link.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include "stack.h"
+#include "symidx.h"
 
+#define SYM_OBJS        128
+#define SYM_PATH        "/var/cache/symidx"
+#define STACK_MAX_STEP  (1024*1024)     /* Largest frame a walk steps over    */
+
+ /* A loaded object and its mapped symbol index, if there is one */
+ typedef struct {
+         unsigned long  lo, hi;          /* Address range of its PT_LOADs      */
+         unsigned long  bias;
+         const SFI_HDR *sfi;             /* NULL: no usable index              */
+ } SYM_OBJ;
+
+ typedef struct {
+         unsigned long  pc;
+         SYM_OBJ        obj;
+         int            id_size;
+         unsigned char  id[SFI_ID_MAX];
+ } SYM_SEARCH;
+
+ /*
+  * Entries are filled in before sym_nobj covers them and never change
+  * after, so lookups read the table without a lock.  sym_lock only
+  * serialises adding; it is a spinlock so lockprof does not see it.
+  */
+ SYM_OBJ sym_obj[SYM_OBJS];
+ volatile int sym_nobj;
+ volatile int sym_lock;
+
+
+ /* The calling thread's stack, [stack_lo, stack_hi); 0: not looked up */
+ __thread unsigned long stack_lo, stack_hi;
+
+ /*
+  * Look up the calling thread's stack bounds, once.  pthread_getattr_np()
+  * is not async-signal-safe (for the main thread it reads
+  * /proc/self/maps), so a thread whose stack is walked from a signal
+  * handler calls this beforehand; watchdog_register() does.  When the
+  * bounds cannot be had every walk comes back empty.
+  */
+ void stack_bounds(void)
+ {
+         pthread_attr_t attr;
+         size_t size;
+         void *lo;
+
+         if(stack_hi)
+                 return;
+         stack_lo = stack_hi = 1;
+         if(pthread_getattr_np(pthread_self(), &attr))
+                 return;
+         if(!pthread_attr_getstack(&attr, &lo, &size))
+         {
+                 stack_lo = (unsigned long)lo;
+                 stack_hi = (unsigned long)lo + size;
+         }
+         pthread_attr_destroy(&attr);
+ }
+
+ /*
+  * Walk the EBP chain from frame and store up to max return addresses
+  * (RIP = frame[1]) in pc.  The walk ends at the outermost frame, whose
+  * saved EBP is 0, or when the saved EBP does not point further up the
+  * stack.  Code built without frame pointers leaves arbitrary data in
+  * EBP, so every frame must also lie on this thread's stack, be word
+  * aligned and be at most STACK_MAX_STEP above the one before.  Returns
+  * the number of addresses stored.
+  */
+ int stack_walk(unsigned long *frame, unsigned long *pc, int max)
+ {
+         unsigned long f = (unsigned long)frame, next;
+         int i = 0;
+
+         stack_bounds();
+         while(i < max && f >= stack_lo && f <= stack_hi - 2 * sizeof(long) &&
+               !(f & (sizeof(long) - 1)))
+         {
+                 pc[i++] = ((unsigned long *)f)[1];
+                 /* The outermost frame has a zero saved EBP but a valid RIP */
+                 next = *(unsigned long *)f;
+                 if(next <= f || next - f > STACK_MAX_STEP)
+                         break;
+                 f = next;
+         }
+         return i;
+ }
+
+ /* Return addresses of the caller's stack, innermost first */
+ __attribute__((noinline))
+ int stack_capture(unsigned long *pc, int max)
+ {
+         return stack_walk((unsigned long *)__builtin_frame_address(0), pc, max);
+ }
+
+ int sym_phdr(struct dl_phdr_info *info, size_t size, void *arg)
+ {
+         SYM_SEARCH *s = arg;
+         const ElfW(Phdr) *ph = info->dlpi_phdr;
+         unsigned long lo = ~0UL, hi = 0, a;
+         int i, found = 0;
+
+         for(i=0;i<info->dlpi_phnum;i++)
+         {
+                 if(ph[i].p_type != PT_LOAD)
+                         continue;
+                 a = info->dlpi_addr + ph[i].p_vaddr;
+                 if(s->pc >= a && s->pc < a + ph[i].p_memsz)
+                         found = 1;
+                 if(a < lo)
+                         lo = a;
+                 if(a + ph[i].p_memsz > hi)
+                         hi = a + ph[i].p_memsz;
+         }
+         if(!found)
+                 return 0;
+         s->obj.lo = lo;
+         s->obj.hi = hi;
+         s->obj.bias = info->dlpi_addr;
+         for(i=0;i<info->dlpi_phnum;i++)
+         {
+                 const char *p, *end;
+                 const ElfW(Nhdr) *n;
+
+                 if(ph[i].p_type != PT_NOTE)
+                         continue;
+                 p = (const char *)(info->dlpi_addr + ph[i].p_vaddr);
+                 end = p + ph[i].p_memsz;
+                 while(p + sizeof(*n) <= end)
+                 {
+                         n = (const ElfW(Nhdr) *)p;
+                         p += sizeof(*n);
+                         if(n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 &&
+                            !memcmp(p, "GNU", 4) && n->n_descsz <= SFI_ID_MAX)
+                         {
+                                 s->id_size = n->n_descsz;
+                                 memcpy(s->id, p + 4, n->n_descsz);
+                                 return 1;
+                         }
+                         p += ((n->n_namesz + 3) & ~3) + ((n->n_descsz + 3) & ~3);
+                 }
+         }
+         return 1;
+ }
+
+ /*
+  * Map <dir>/<build-id>.sfi and check it is whole and the index of this
+  * build; stack_resolve() trusts its tables after that.
+  */
+ const SFI_HDR *sym_map(unsigned char *id, int id_size)
+ {
+         char path[512], hex[2 * SFI_ID_MAX + 1], *dir = getenv("SYMIDX_PATH");
+         const SFI_HDR *h;
+         struct stat st;
+         int fd, i;
+
+         if(!id_size || id_size > SFI_ID_MAX)
+                 return NULL;
+         for(i=0;i<id_size;i++)
+                 snprintf(hex + 2 * i, 3, "%02x", id[i]);
+         /* A $SYMIDX_PATH too long for path means no index */
+         if(snprintf(path, sizeof(path), "%s/%s.sfi", dir ? dir : SYM_PATH, hex) >= (int)sizeof(path))
+                 return NULL;
+         fd = open(path, O_RDONLY);
+         if(fd < 0)
+                 return NULL;
+         h = MAP_FAILED;
+         if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SFI_HDR))
+                 h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+         close(fd);
+         if(h == MAP_FAILED)
+                 return NULL;
+         if(!sfi_valid(h, st.st_size) ||
+            h->id_size != (unsigned)id_size || memcmp(h->id, id, id_size))
+         {
+                 munmap((void *)h, st.st_size);
+                 return NULL;
+         }
+         return h;
+ }
+
+ /* The object holding pc, found and its index mapped on first use */
+ SYM_OBJ *sym_object(unsigned long pc)
+ {
+         SYM_SEARCH s;
+         int i, added = 0;
+
+         for(i=0;i<sym_nobj;i++)
+                 if(pc >= sym_obj[i].lo && pc < sym_obj[i].hi)
+                         return &sym_obj[i];
+         memset(&s, 0, sizeof(s));
+         s.pc = pc;
+         if(!dl_iterate_phdr(sym_phdr, &s))
+                 return NULL;
+         s.obj.sfi = sym_map(s.id, s.id_size);
+
+         while(__sync_lock_test_and_set(&sym_lock, 1))
+                 while(sym_lock)
+                         ;
+         /* Someone may have added it meanwhile */
+         for(i=0;i<sym_nobj;i++)
+                 if(pc >= sym_obj[i].lo && pc < sym_obj[i].hi)
+                         break;
+         if(i == sym_nobj && i < SYM_OBJS)
+         {
+                 sym_obj[i] = s.obj;
+                 __sync_synchronize();
+                 sym_nobj = i + 1;
+                 added = 1;
+         }
+         __sync_lock_release(&sym_lock);
+         if(!added && s.obj.sfi)
+                 munmap((void *)s.obj.sfi, s.obj.sfi->str_off + s.obj.sfi->str_size);
+         return i < sym_nobj ? &sym_obj[i] : NULL;
+ }
+
+ /*
+  * Resolve pc through its object's symbol index into source frames,
+  * innermost first: the inlined functions pc is in, then the function
+  * they were inlined into.  The innermost frame's file and line are
+  * pc's line table row, each outer frame's the call site of the frame
+  * inside it.  Three binary searches and a walk up the inline parents.
+  * Returns the number of frames, 0 when the object has no index or pc is
+  * in no known function.
+  */
+ int stack_resolve(unsigned long pc, STACK_FRAME *f, int max)
+ {
+         SYM_OBJ *o = sym_object(pc);
+         const SFI_HDR *h;
+         const SFI_FUNC *fn;
+         const SFI_SEG *seg;
+         const SFI_INLINE *in;
+         const SFI_LINE *ln;
+         const char *file = NULL;
+         unsigned long long a;
+         unsigned int i;
+         int n = 0, line = 0, lo, hi, mid;
+
+         if(!o || !o->sfi || max < 1)
+                 return 0;
+         h = o->sfi;
+         a = pc - o->bias;
+         fn = (const SFI_FUNC *)((const char *)h + h->func_off);
+         seg = (const SFI_SEG *)((const char *)h + h->seg_off);
+         in = (const SFI_INLINE *)((const char *)h + h->inline_off);
+         ln = (const SFI_LINE *)((const char *)h + h->line_off);
+
+         for(lo=0, hi=h->nfunc-1;lo<=hi;)
+         {
+                 mid = (lo + hi) / 2;
+                 if(fn[mid].start <= a)
+                         lo = mid + 1;
+                 else
+                         hi = mid - 1;
+         }
+         if(hi < 0 || a >= fn[hi].end)
+                 return 0;
+         fn += hi;
+
+         for(lo=0, hi=h->nline-1;lo<=hi;)
+         {
+                 mid = (lo + hi) / 2;
+                 if(ln[mid].start <= a)
+                         lo = mid + 1;
+                 else
+                         hi = mid - 1;
+         }
+         if(hi >= 0 && ln[hi].file)
+         {
+                 file = sfi_str(h, ln[hi].file);
+                 line = ln[hi].line;
+         }
+
+         for(lo=0, hi=h->nseg-1;lo<=hi;)
+         {
+                 mid = (lo + hi) / 2;
+                 if(seg[mid].start <= a)
+                         lo = mid + 1;
+                 else
+                         hi = mid - 1;
+         }
+         for(i=hi>=0 ? seg[hi].inl : SFI_NONE;i!=SFI_NONE && i<h->ninline && n<max-1;i=in[i].parent)
+         {
+                 f[n].func = sfi_str(h, in[i].name);
+                 f[n].offset = 0;
+                 f[n].file = file;
+                 f[n].line = line;
+                 n++;
+                 file = in[i].call_file ? sfi_str(h, in[i].call_file) : NULL;
+                 line = in[i].call_line;
+         }
+         f[n].func = sfi_str(h, fn->name);
+         f[n].offset = a - fn->start;
+         f[n].file = file;
+         f[n].line = line;
+         return n + 1;
+ }
+
+ /*
+  * Name pc as "function+0xoff", "object+0xoff" when the object exports
+  * no symbol for it, or "0xaddr".  The object's symbol index is used
+  * when there is one, otherwise dladdr(), which only sees dynamic
+  * symbols; link executables with -rdynamic.
+  */
+ int stack_symbol(unsigned long pc, char *buf, int len)
+ {
+         STACK_FRAME f[16];
+         Dl_info info;
+         char *obj;
+         int n;
+
+         n = stack_resolve(pc, f, 16);
+         if(n && f[n-1].func[0])
+                 return snprintf(buf, len, "%s+0x%lx", f[n-1].func, f[n-1].offset);
+
+         if(!dladdr((void *)pc, &info) || !info.dli_fname)
+                 return snprintf(buf, len, "0x%lx", pc);
+         if(info.dli_sname)
+                 return snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                                 pc - (unsigned long)info.dli_saddr);
+         obj = strrchr(info.dli_fname, '/');
+         return snprintf(buf, len, "%s+0x%lx", obj ? obj + 1 : info.dli_fname,
+                         pc - (unsigned long)info.dli_fbase);
+ }
+
+ /*
+  * Print a stack from stack_walk() to fd, one line per source frame, with
+  * inlined frames expanded when the objects have symbol indexes:
+  *
+  *   0x0804a1b2 leaf at t.c:7 (inlined)
+  *              mid at t.c:10 (inlined)
+  *              top+0x1c at t.c:11
+  *
+  * Entries after the first n_exact are return addresses and are looked
+  * up one byte back, inside the call.
+  */
+ void stack_print(int fd, unsigned long *pc, int depth, int n_exact)
+ {
+         STACK_FRAME f[16];
+         char sym[256];
+         int i, j, n, w;
+
+         for(i=0;i<depth;i++)
+         {
+                 n = stack_resolve(i < n_exact ? pc[i] : pc[i] - 1, f, 16);
+                 if(!n)
+                 {
+                         stack_symbol(i < n_exact ? pc[i] : pc[i] - 1, sym, sizeof(sym));
+                         dprintf(fd, "  0x%08lx %s\n", pc[i], sym);
+                         continue;
+                 }
+                 w = dprintf(fd, "  0x%08lx", pc[i]);
+                 for(j=0;j<n;j++)
+                 {
+                         if(j)
+                                 dprintf(fd, "%*s", w, "");
+                         dprintf(fd, " %s", f[j].func[0] ? f[j].func : "??");
+                         if(j == n - 1)
+                                 dprintf(fd, "+0x%lx", f[j].offset);
+                         if(f[j].file)
+                                 dprintf(fd, " at %s:%d", f[j].file, f[j].line);
+                         dprintf(fd, "%s\n", j < n - 1 ? " (inlined)" : "");
+                 }
+         }
+ }
 
  void fun_stack()
  {
          register int ebp asm("ebp");
          int *frame = (int *)ebp;
-         int stack[10];
+         unsigned long stack[10];
          int i = 0;
 
          while(*frame)
          {
                  printf("EBP:0x%x RIP:0x%x \n", *frame, frame[1]);
-                 stack[i] = frame[1];
-                 frame  = *frame;
-                 i++;
+                 frame  = (int *)*frame;
          }
 
          /*add(a, b);*/
          /*RIP*/
-         backtrace_symbols_fd(stack, i, 0);
+         i = stack_walk((unsigned long *)ebp, stack, 10);
+         backtrace_symbols_fd((void **)stack, i, 0);
 
          //
          //
@@ -461,7 +833,9 @@
          fun_inner();
  }
 
+#ifndef STACK_NO_MAIN
  int main(int argc, char *argv[])
  {
          fun_outer();
  }
+#endif
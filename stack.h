@@ -0,0 +1,30 @@
+#ifndef STACK_H
+#define STACK_H
+
+/*
+ * Frame pointer stack walker from stack.c.  Build stack.c with
+ * -DSTACK_NO_MAIN to link it into another program.  Code being walked
+ * needs its EBP chain, i.e. -fno-omit-frame-pointer; in code without it
+ * the walk stops early, kept to the thread's stack by stack_bounds().
+ */
+#define STACK_MAX_DEPTH 64
+
+/*
+ * One source level frame of a pc, from the object's symbol index (see
+ * symidx.h).  A pc inside inlined code resolves to several of these.
+ */
+typedef struct {
+        const char    *func;
+        unsigned long  offset;        /* pc - start of func, real frame only */
+        const char    *file;          /* NULL when not known                 */
+        int            line;
+} STACK_FRAME;
+
+void stack_bounds(void);
+int stack_walk(unsigned long *frame, unsigned long *pc, int max);
+int stack_capture(unsigned long *pc, int max);
+int stack_symbol(unsigned long pc, char *buf, int len);
+int stack_resolve(unsigned long pc, STACK_FRAME *f, int max);
+void stack_print(int fd, unsigned long *pc, int depth, int n_exact);
+
+#endif
@@ -0,0 +1,1570 @@
+/*
+ * symidx: compile an object's symbols into a .sfi symbol index.
+ *
+ *   gcc -O2 -g symidx.c -o symidx
+ *   symidx [-o dir] binary [debugfile]
+ *
+ * Writes dir/<build-id>.sfi (see symidx.h) from the ELF .symtab (.dynsym
+ * when stripped), the DW_TAG_subprogram / DW_TAG_inlined_subroutine
+ * ranges of .debug_info and the .debug_line rows, DWARF 2 to 5.
+ * debugfile is a separate debug file for binary, e.g.
+ * /usr/lib/debug/.build-id/xx/yyyy.debug; the build-id is always taken
+ * from binary.  Both ELF32 and ELF64 inputs are handled, little endian
+ * only.  Compressed debug sections are not read.
+ *
+ * The runtime side is stack_resolve() in stack.c, which looks for
+ * indexes in $SYMIDX_PATH, default /var/cache/symidx.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symidx.h"
+
+#define DW_TAG_compile_unit             0x11
+#define DW_TAG_partial_unit             0x3c
+#define DW_TAG_subprogram               0x2e
+#define DW_TAG_inlined_subroutine       0x1d
+
+#define DW_AT_name                      0x03
+#define DW_AT_stmt_list                 0x10
+#define DW_AT_low_pc                    0x11
+#define DW_AT_high_pc                   0x12
+#define DW_AT_comp_dir                  0x1b
+#define DW_AT_abstract_origin           0x31
+#define DW_AT_specification             0x47
+#define DW_AT_ranges                    0x55
+#define DW_AT_call_file                 0x58
+#define DW_AT_call_line                 0x59
+#define DW_AT_linkage_name              0x6e
+#define DW_AT_str_offsets_base          0x72
+#define DW_AT_addr_base                 0x73
+#define DW_AT_rnglists_base             0x74
+#define DW_AT_MIPS_linkage_name         0x2007
+
+#define DW_FORM_addr            0x01
+#define DW_FORM_block2          0x03
+#define DW_FORM_block4          0x04
+#define DW_FORM_data2           0x05
+#define DW_FORM_data4           0x06
+#define DW_FORM_data8           0x07
+#define DW_FORM_string          0x08
+#define DW_FORM_block           0x09
+#define DW_FORM_block1          0x0a
+#define DW_FORM_data1           0x0b
+#define DW_FORM_flag            0x0c
+#define DW_FORM_sdata           0x0d
+#define DW_FORM_strp            0x0e
+#define DW_FORM_udata           0x0f
+#define DW_FORM_ref_addr        0x10
+#define DW_FORM_ref1            0x11
+#define DW_FORM_ref2            0x12
+#define DW_FORM_ref4            0x13
+#define DW_FORM_ref8            0x14
+#define DW_FORM_ref_udata       0x15
+#define DW_FORM_indirect        0x16
+#define DW_FORM_sec_offset      0x17
+#define DW_FORM_exprloc         0x18
+#define DW_FORM_flag_present    0x19
+#define DW_FORM_strx            0x1a
+#define DW_FORM_addrx           0x1b
+#define DW_FORM_ref_sup4        0x1c
+#define DW_FORM_strp_sup        0x1d
+#define DW_FORM_data16          0x1e
+#define DW_FORM_line_strp       0x1f
+#define DW_FORM_ref_sig8        0x20
+#define DW_FORM_implicit_const  0x21
+#define DW_FORM_loclistx        0x22
+#define DW_FORM_rnglistx        0x23
+#define DW_FORM_ref_sup8        0x24
+#define DW_FORM_strx1           0x25
+#define DW_FORM_strx2           0x26
+#define DW_FORM_strx3           0x27
+#define DW_FORM_strx4           0x28
+#define DW_FORM_addrx1          0x29
+#define DW_FORM_addrx2          0x2a
+#define DW_FORM_addrx3          0x2b
+#define DW_FORM_addrx4          0x2c
+#define DW_FORM_GNU_addr_index  0x1f01
+#define DW_FORM_GNU_str_index   0x1f02
+#define DW_FORM_GNU_ref_alt     0x1f20
+#define DW_FORM_GNU_strp_alt    0x1f21
+
+#define DW_RLE_end_of_list      0
+#define DW_RLE_base_addressx    1
+#define DW_RLE_startx_endx      2
+#define DW_RLE_startx_length    3
+#define DW_RLE_offset_pair      4
+#define DW_RLE_base_address     5
+#define DW_RLE_start_end        6
+#define DW_RLE_start_length     7
+
+#define DW_LNS_copy                     1
+#define DW_LNS_advance_pc               2
+#define DW_LNS_advance_line             3
+#define DW_LNS_set_file                 4
+#define DW_LNS_const_add_pc             8
+#define DW_LNS_fixed_advance_pc         9
+
+#define DW_LNE_end_sequence             1
+#define DW_LNE_set_address              2
+#define DW_LNE_define_file              3
+
+#define DW_LNCT_path                    1
+#define DW_LNCT_directory_index         2
+
+#define MAX_DIE_DEPTH   256
+
+/* ELF input, ELF32 and ELF64 section headers folded into one shape */
+typedef struct section {
+        const char    *name;
+        const uint8_t *data;
+        uint64_t       size;
+        uint32_t       type;
+        uint32_t       link;
+        uint64_t       flags;
+        uint64_t       entsize;
+} SECTION;
+
+typedef struct elf_file {
+        const uint8_t *map;
+        size_t         size;
+        int            is64;
+        int            nsec;
+        SECTION       *sec;
+} ELF_FILE;
+
+/* Output being built */
+typedef struct str_pool {
+        char          *buf;
+        uint32_t       len, cap;
+        uint32_t      *hash;          /* Offsets, 0 = empty                  */
+        uint32_t       nhash, used;
+} STR_POOL;
+
+typedef struct line_row {
+        uint64_t       start;
+        uint32_t       file;
+        uint32_t       line;
+        uint32_t       seq;           /* Input order, for equal starts       */
+        uint32_t       end;           /* Row ends a sequence                 */
+} LINE_ROW;
+
+typedef struct range {
+        uint64_t       start;
+        uint64_t       end;
+        uint32_t       inl;
+        uint32_t       depth;         /* Inline nesting, outermost 1         */
+} RANGE;
+
+SFI_FUNC *func;
+int nfunc, func_cap;
+SFI_INLINE *inl;
+uint32_t *inl_depth;
+int ninl, inl_cap;
+RANGE *range;
+int nrange, range_cap;
+SFI_SEG *seg;
+int nseg, seg_cap;
+LINE_ROW *row;
+int nrow, row_cap;
+STR_POOL pool;
+
+/* DWARF state */
+typedef struct abbrev_attr {
+        uint64_t       name;
+        uint64_t       form;
+        int64_t        implicit;
+} ABBREV_ATTR;
+
+typedef struct abbrev {
+        uint64_t       code;
+        uint64_t       tag;
+        int            children;
+        int            nattr;
+        ABBREV_ATTR   *attr;
+} ABBREV;
+
+typedef struct abbrev_table {
+        uint64_t       off;
+        int            n;
+        ABBREV        *a;
+} ABBREV_TABLE;
+
+typedef struct cu {
+        uint64_t       off;           /* Unit header in .debug_info          */
+        uint64_t       end;
+        uint64_t       die;           /* First DIE                           */
+        int            version;
+        int            addr_size;
+        int            offset_size;
+        ABBREV_TABLE  *abbrev;
+        uint64_t       str_offsets_base;
+        uint64_t       addr_base;
+        uint64_t       rnglists_base;
+        uint64_t       low_pc;
+        int            has_stmt_list;
+        uint64_t       stmt_list;
+        const char    *comp_dir;
+        uint32_t      *file;          /* Line table files as path strings    */
+        int            nfile;
+        int            file_base;     /* Index of file[0]: 1 before DWARF 5  */
+} CU;
+
+typedef struct val {
+        uint64_t       form;
+        uint64_t       u;
+        const char    *s;
+} VAL;
+
+typedef struct die {
+        uint64_t       off;
+        uint64_t       next;          /* Offset of the following DIE         */
+        uint64_t       tag;
+        int            children;
+        int            has_low, has_high, has_ranges;
+        VAL            name, linkage, low, high, ranges;
+        uint64_t       origin;        /* abstract_origin or specification    */
+        uint64_t       call_file, call_line;
+        uint64_t       stmt_list;
+        VAL            comp_dir;
+        int            has_stmt_list;
+} DIE;
+
+typedef struct dwarf {
+        SECTION       *info, *abbrev, *str, *line_str, *ranges, *rnglists;
+        SECTION       *str_offsets, *addr, *line;
+        CU            *cu;
+        int            ncu;
+        ABBREV_TABLE  *tables;
+        int            ntables;
+} DWARF;
+
+DWARF dw;
+
+void *grow(void *p, int *cap, int need, size_t size)
+{
+        if(need <= *cap)
+                return p;
+        *cap = *cap ? *cap * 2 : 1024;
+        if(*cap < need)
+                *cap = need;
+        p = realloc(p, *cap * size);
+        if(!p)
+        {
+                perror("symidx: out of memory");
+                exit(1);
+        }
+        return p;
+}
+
+/* ---- ELF ---- */
+
+int elf_open(ELF_FILE *e, const char *path)
+{
+        struct stat st;
+        const uint8_t *m;
+        uint64_t shoff, shentsize;
+        int fd, i, shstrndx;
+        const char *names;
+
+        memset(e, 0, sizeof(*e));
+        fd = open(path, O_RDONLY);
+        if(fd < 0 || fstat(fd, &st) < 0)
+        {
+                perror(path);
+                return -1;
+        }
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(m == MAP_FAILED || st.st_size < (off_t)sizeof(Elf32_Ehdr) ||
+           memcmp(m, ELFMAG, SELFMAG) || m[EI_DATA] != ELFDATA2LSB)
+        {
+                fprintf(stderr, "%s: not a little endian ELF file\n", path);
+                return -1;
+        }
+        e->map = m;
+        e->size = st.st_size;
+        e->is64 = m[EI_CLASS] == ELFCLASS64;
+        if(e->is64)
+        {
+                const Elf64_Ehdr *h = (const Elf64_Ehdr*)m;
+                shoff = h->e_shoff;
+                shentsize = h->e_shentsize;
+                e->nsec = h->e_shnum;
+                shstrndx = h->e_shstrndx;
+        }
+        else
+        {
+                const Elf32_Ehdr *h = (const Elf32_Ehdr*)m;
+                shoff = h->e_shoff;
+                shentsize = h->e_shentsize;
+                e->nsec = h->e_shnum;
+                shstrndx = h->e_shstrndx;
+        }
+        if(shoff + e->nsec * shentsize > e->size)
+        {
+                fprintf(stderr, "%s: truncated section headers\n", path);
+                return -1;
+        }
+        e->sec = calloc(e->nsec, sizeof(SECTION));
+        for(i=0;i<e->nsec;i++)
+        {
+                SECTION *s = &e->sec[i];
+                uint64_t off;
+                uint32_t name;
+
+                if(e->is64)
+                {
+                        const Elf64_Shdr *h = (const Elf64_Shdr*)(m + shoff + i * shentsize);
+                        name = h->sh_name; s->type = h->sh_type; s->flags = h->sh_flags;
+                        off = h->sh_offset; s->size = h->sh_size;
+                        s->link = h->sh_link; s->entsize = h->sh_entsize;
+                }
+                else
+                {
+                        const Elf32_Shdr *h = (const Elf32_Shdr*)(m + shoff + i * shentsize);
+                        name = h->sh_name; s->type = h->sh_type; s->flags = h->sh_flags;
+                        off = h->sh_offset; s->size = h->sh_size;
+                        s->link = h->sh_link; s->entsize = h->sh_entsize;
+                }
+                if(s->type == SHT_NOBITS || off + s->size > e->size)
+                        s->size = 0;
+                s->data = m + off;
+                s->name = (const char*)(uintptr_t)name;
+        }
+        names = shstrndx < e->nsec ? (const char*)e->sec[shstrndx].data : NULL;
+        for(i=0;i<e->nsec;i++)
+                e->sec[i].name = names ? names + (uintptr_t)e->sec[i].name : "";
+        return 0;
+}
+
+SECTION *elf_section(ELF_FILE *e, const char *name)
+{
+        int i;
+
+        for(i=0;i<e->nsec;i++)
+                if(!strcmp(e->sec[i].name, name) && e->sec[i].size &&
+                   !(e->sec[i].flags & SHF_COMPRESSED))
+                        return &e->sec[i];
+        return NULL;
+}
+
+int elf_build_id(ELF_FILE *e, uint8_t *id)
+{
+        const uint8_t *p, *end;
+        uint32_t namesz, descsz, type;
+        int i;
+
+        for(i=0;i<e->nsec;i++)
+        {
+                if(e->sec[i].type != SHT_NOTE)
+                        continue;
+                p = e->sec[i].data;
+                end = p + e->sec[i].size;
+                while(p + 12 <= end)
+                {
+                        memcpy(&namesz, p, 4);
+                        memcpy(&descsz, p + 4, 4);
+                        memcpy(&type, p + 8, 4);
+                        p += 12;
+                        if(type == NT_GNU_BUILD_ID && namesz == 4 && !memcmp(p, "GNU", 4) &&
+                           descsz <= SFI_ID_MAX)
+                        {
+                                memcpy(id, p + 4, descsz);
+                                return descsz;
+                        }
+                        p += ((namesz + 3) & ~3) + ((descsz + 3) & ~3);
+                }
+        }
+        return 0;
+}
+
+/* ---- output tables ---- */
+
+uint32_t str_add(const char *s)
+{
+        uint32_t h = 2166136261u, len = strlen(s) + 1, i, off;
+
+        if(!s[0])
+                return 0;
+        for(i=0;s[i];i++)
+                h = (h ^ (uint8_t)s[i]) * 16777619u;
+        if(pool.used * 2 >= pool.nhash)
+        {
+                uint32_t *old = pool.hash, n = pool.nhash, j;
+
+                pool.nhash = n ? n * 2 : 4096;
+                pool.hash = calloc(pool.nhash, sizeof(uint32_t));
+                for(j=0;j<n;j++)
+                        if(old[j])
+                        {
+                                const char *t = pool.buf + old[j];
+                                uint32_t g = 2166136261u, k;
+
+                                for(k=0;t[k];k++)
+                                        g = (g ^ (uint8_t)t[k]) * 16777619u;
+                                for(k=g;pool.hash[k & (pool.nhash-1)];k++)
+                                        ;
+                                pool.hash[k & (pool.nhash-1)] = old[j];
+                        }
+                free(old);
+        }
+        for(i=h;(off = pool.hash[i & (pool.nhash-1)]);i++)
+                if(!strcmp(pool.buf + off, s))
+                        return off;
+        if(pool.len + len > pool.cap)
+        {
+                pool.cap = (pool.len + len) * 2;
+                pool.buf = realloc(pool.buf, pool.cap);
+        }
+        off = pool.len;
+        memcpy(pool.buf + off, s, len);
+        pool.len += len;
+        pool.hash[i & (pool.nhash-1)] = off;
+        pool.used++;
+        return off;
+}
+
+void func_add(uint64_t start, uint64_t end, const char *name)
+{
+        func = grow(func, &func_cap, nfunc + 1, sizeof(SFI_FUNC));
+        func[nfunc].start = start;
+        func[nfunc].end = end;
+        func[nfunc].name = str_add(name);
+        func[nfunc].pad = 0;
+        nfunc++;
+}
+
+int func_cmp(const void *a, const void *b)
+{
+        const SFI_FUNC *x = a, *y = b;
+
+        if(x->start != y->start)
+                return x->start < y->start ? -1 : 1;
+        /* Sized symbols first among aliases */
+        return (y->end - y->start) > (x->end - x->start) ? 1 : -1;
+}
+
+/* Sort, drop aliases and give unsized symbols the gap to the next one */
+void func_finish(void)
+{
+        int i, n = 0;
+
+        qsort(func, nfunc, sizeof(SFI_FUNC), func_cmp);
+        for(i=0;i<nfunc;i++)
+                if(!n || func[i].start != func[n-1].start)
+                        func[n++] = func[i];
+        nfunc = n;
+        for(i=0;i<nfunc;i++)
+                if(func[i].end <= func[i].start)
+                        func[i].end = i + 1 < nfunc ? func[i+1].start : func[i].start + 1;
+}
+
+SFI_FUNC *func_find(uint64_t pc)
+{
+        int lo = 0, hi = nfunc - 1, mid;
+
+        while(lo <= hi)
+        {
+                mid = (lo + hi) / 2;
+                if(func[mid].start <= pc)
+                        lo = mid + 1;
+                else
+                        hi = mid - 1;
+        }
+        return hi >= 0 && pc < func[hi].end ? &func[hi] : NULL;
+}
+
+void load_symtab(ELF_FILE *e)
+{
+        SECTION *sym = NULL, *str;
+        uint64_t i, n, value, size;
+        uint32_t name;
+        int k, type, shndx;
+
+        for(k=0;k<e->nsec;k++)
+                if(e->sec[k].type == SHT_SYMTAB && e->sec[k].size)
+                        sym = &e->sec[k];
+        if(!sym)
+                for(k=0;k<e->nsec;k++)
+                        if(e->sec[k].type == SHT_DYNSYM && e->sec[k].size)
+                                sym = &e->sec[k];
+        if(!sym || sym->link >= (uint32_t)e->nsec)
+                return;
+        str = &e->sec[sym->link];
+        n = sym->size / (e->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym));
+        for(i=0;i<n;i++)
+        {
+                if(e->is64)
+                {
+                        const Elf64_Sym *s = (const Elf64_Sym*)sym->data + i;
+                        name = s->st_name; value = s->st_value; size = s->st_size;
+                        type = ELF64_ST_TYPE(s->st_info); shndx = s->st_shndx;
+                }
+                else
+                {
+                        const Elf32_Sym *s = (const Elf32_Sym*)sym->data + i;
+                        name = s->st_name; value = s->st_value; size = s->st_size;
+                        type = ELF32_ST_TYPE(s->st_info); shndx = s->st_shndx;
+                }
+                if((type != STT_FUNC && type != STT_GNU_IFUNC) || shndx == SHN_UNDEF ||
+                   !value || name >= str->size)
+                        continue;
+                func_add(value, value + size, (const char*)str->data + name);
+        }
+}
+
+/* ---- DWARF readers ---- */
+
+uint64_t rd(const uint8_t **p, int size)
+{
+        uint64_t v = 0;
+
+        memcpy(&v, *p, size);
+        *p += size;
+        return v;
+}
+
+uint64_t uleb(const uint8_t **p)
+{
+        uint64_t v = 0;
+        int shift = 0;
+        uint8_t b;
+
+        do
+        {
+                b = *(*p)++;
+                if(shift < 64)
+                        v |= (uint64_t)(b & 0x7f) << shift;
+                shift += 7;
+        }while(b & 0x80);
+        return v;
+}
+
+int64_t sleb(const uint8_t **p)
+{
+        int64_t v = 0;
+        int shift = 0;
+        uint8_t b;
+
+        do
+        {
+                b = *(*p)++;
+                if(shift < 64)
+                        v |= (int64_t)(b & 0x7f) << shift;
+                shift += 7;
+        }while(b & 0x80);
+        if(shift < 64 && (b & 0x40))
+                v |= -((int64_t)1 << shift);
+        return v;
+}
+
+ABBREV_TABLE *abbrev_table(uint64_t off)
+{
+        ABBREV_TABLE *t;
+        const uint8_t *p, *end;
+        ABBREV *a;
+        int i, cap = 0, acap;
+
+        for(i=0;i<dw.ntables;i++)
+                if(dw.tables[i].off == off)
+                        return &dw.tables[i];
+        dw.tables = realloc(dw.tables, (dw.ntables + 1) * sizeof(ABBREV_TABLE));
+        t = &dw.tables[dw.ntables++];
+        t->off = off;
+        t->n = 0;
+        t->a = NULL;
+        if(!dw.abbrev || off >= dw.abbrev->size)
+                return t;
+        p = dw.abbrev->data + off;
+        end = dw.abbrev->data + dw.abbrev->size;
+        while(p < end)
+        {
+                uint64_t code = uleb(&p), name, form;
+
+                if(!code)
+                        break;
+                t->a = grow(t->a, &cap, t->n + 1, sizeof(ABBREV));
+                a = &t->a[t->n++];
+                a->code = code;
+                a->tag = uleb(&p);
+                a->children = *p++;
+                a->nattr = 0;
+                a->attr = NULL;
+                acap = 0;
+                while(p < end)
+                {
+                        name = uleb(&p);
+                        form = uleb(&p);
+                        if(!name && !form)
+                                break;
+                        a->attr = grow(a->attr, &acap, a->nattr + 1, sizeof(ABBREV_ATTR));
+                        a->attr[a->nattr].name = name;
+                        a->attr[a->nattr].form = form;
+                        a->attr[a->nattr].implicit =
+                                form == DW_FORM_implicit_const ? sleb(&p) : 0;
+                        a->nattr++;
+                }
+        }
+        return t;
+}
+
+ABBREV *abbrev_find(ABBREV_TABLE *t, uint64_t code)
+{
+        int i;
+
+        /* Codes are normally handed out 1, 2, 3... */
+        if(code && code <= (uint64_t)t->n && t->a[code-1].code == code)
+                return &t->a[code-1];
+        for(i=0;i<t->n;i++)
+                if(t->a[i].code == code)
+                        return &t->a[i];
+        return NULL;
+}
+
+/* Read one attribute value of the given form, advancing p */
+void read_form(CU *cu, uint64_t form, int64_t implicit, const uint8_t **p, VAL *v)
+{
+        v->form = form;
+        v->s = NULL;
+        v->u = 0;
+        switch(form)
+        {
+        case DW_FORM_addr:          v->u = rd(p, cu->addr_size); break;
+        case DW_FORM_block2:        *p += rd(p, 2); break;
+        case DW_FORM_block4:        *p += rd(p, 4); break;
+        case DW_FORM_data2:
+        case DW_FORM_ref2:          v->u = rd(p, 2); break;
+        case DW_FORM_data4:
+        case DW_FORM_ref4:
+        case DW_FORM_ref_sup4:      v->u = rd(p, 4); break;
+        case DW_FORM_data8:
+        case DW_FORM_ref8:
+        case DW_FORM_ref_sig8:
+        case DW_FORM_ref_sup8:      v->u = rd(p, 8); break;
+        case DW_FORM_data16:        *p += 16; break;
+        case DW_FORM_string:        v->s = (const char*)*p; *p += strlen(v->s) + 1; break;
+        case DW_FORM_block:
+        case DW_FORM_exprloc:       v->u = uleb(p); *p += v->u; break;
+        case DW_FORM_block1:        *p += rd(p, 1); break;
+        case DW_FORM_data1:
+        case DW_FORM_ref1:
+        case DW_FORM_flag:          v->u = rd(p, 1); break;
+        case DW_FORM_sdata:         v->u = sleb(p); break;
+        case DW_FORM_udata:
+        case DW_FORM_ref_udata:
+        case DW_FORM_strx:
+        case DW_FORM_addrx:
+        case DW_FORM_loclistx:
+        case DW_FORM_rnglistx:
+        case DW_FORM_GNU_addr_index:
+        case DW_FORM_GNU_str_index: v->u = uleb(p); break;
+        case DW_FORM_strp:
+        case DW_FORM_line_strp:
+        case DW_FORM_sec_offset:
+        case DW_FORM_strp_sup:
+        case DW_FORM_GNU_ref_alt:
+        case DW_FORM_GNU_strp_alt:  v->u = rd(p, cu->offset_size); break;
+        case DW_FORM_ref_addr:      v->u = rd(p, cu->version == 2 ? cu->addr_size : cu->offset_size); break;
+        case DW_FORM_flag_present:  v->u = 1; break;
+        case DW_FORM_implicit_const: v->u = implicit; break;
+        case DW_FORM_strx1:
+        case DW_FORM_addrx1:        v->u = rd(p, 1); break;
+        case DW_FORM_strx2:
+        case DW_FORM_addrx2:        v->u = rd(p, 2); break;
+        case DW_FORM_strx3:
+        case DW_FORM_addrx3:        v->u = rd(p, 3); break;
+        case DW_FORM_strx4:
+        case DW_FORM_addrx4:        v->u = rd(p, 4); break;
+        case DW_FORM_indirect:
+                form = uleb(p);
+                read_form(cu, form, form == DW_FORM_implicit_const ? sleb(p) : 0, p, v);
+                break;
+        default:
+                fprintf(stderr, "symidx: unknown DWARF form 0x%llx\n", (unsigned long long)form);
+                exit(1);
+        }
+}
+
+const char *val_str(CU *cu, VAL *v)
+{
+        uint64_t off;
+        const uint8_t *q;
+
+        switch(v->form)
+        {
+        case DW_FORM_string:
+                return v->s;
+        case DW_FORM_strp:
+                return dw.str && v->u < dw.str->size ? (const char*)dw.str->data + v->u : NULL;
+        case DW_FORM_line_strp:
+                return dw.line_str && v->u < dw.line_str->size ?
+                       (const char*)dw.line_str->data + v->u : NULL;
+        case DW_FORM_strx: case DW_FORM_strx1: case DW_FORM_strx2:
+        case DW_FORM_strx3: case DW_FORM_strx4: case DW_FORM_GNU_str_index:
+                off = cu->str_offsets_base + v->u * cu->offset_size;
+                if(!dw.str_offsets || off + cu->offset_size > dw.str_offsets->size)
+                        return NULL;
+                q = dw.str_offsets->data + off;
+                off = rd(&q, cu->offset_size);
+                return dw.str && off < dw.str->size ? (const char*)dw.str->data + off : NULL;
+        }
+        return NULL;
+}
+
+uint64_t addr_index(CU *cu, uint64_t i)
+{
+        uint64_t off = cu->addr_base + i * cu->addr_size;
+        const uint8_t *q;
+
+        if(!dw.addr || off + cu->addr_size > dw.addr->size)
+                return 0;
+        q = dw.addr->data + off;
+        return rd(&q, cu->addr_size);
+}
+
+uint64_t val_addr(CU *cu, VAL *v)
+{
+        switch(v->form)
+        {
+        case DW_FORM_addrx: case DW_FORM_addrx1: case DW_FORM_addrx2:
+        case DW_FORM_addrx3: case DW_FORM_addrx4: case DW_FORM_GNU_addr_index:
+                return addr_index(cu, v->u);
+        }
+        return v->u;
+}
+
+/* Section offset a reference points to */
+uint64_t val_ref(CU *cu, VAL *v)
+{
+        switch(v->form)
+        {
+        case DW_FORM_ref1: case DW_FORM_ref2: case DW_FORM_ref4:
+        case DW_FORM_ref8: case DW_FORM_ref_udata:
+                return cu->off + v->u;
+        case DW_FORM_ref_addr:
+                return v->u;
+        }
+        return 0;
+}
+
+/* Parse the DIE at off; returns -1 past the unit or on a bad abbrev */
+int die_read(CU *cu, uint64_t off, DIE *d)
+{
+        const uint8_t *p = dw.info->data + off;
+        uint64_t code;
+        ABBREV *a;
+        VAL v;
+        int i;
+
+        memset(d, 0, sizeof(*d));
+        d->off = off;
+        if(off >= cu->end)
+                return -1;
+        code = uleb(&p);
+        if(!code)
+        {
+                d->next = p - dw.info->data;
+                return 0;
+        }
+        a = abbrev_find(cu->abbrev, code);
+        if(!a)
+                return -1;
+        d->tag = a->tag;
+        d->children = a->children;
+        for(i=0;i<a->nattr;i++)
+        {
+                read_form(cu, a->attr[i].form, a->attr[i].implicit, &p, &v);
+                switch(a->attr[i].name)
+                {
+                case DW_AT_name:            d->name = v; break;
+                case DW_AT_linkage_name:
+                case DW_AT_MIPS_linkage_name: d->linkage = v; break;
+                case DW_AT_low_pc:          d->low = v; d->has_low = 1; break;
+                case DW_AT_high_pc:         d->high = v; d->has_high = 1; break;
+                case DW_AT_ranges:          d->ranges = v; d->has_ranges = 1; break;
+                case DW_AT_abstract_origin:
+                case DW_AT_specification:   d->origin = val_ref(cu, &v); break;
+                case DW_AT_call_file:       d->call_file = v.u; break;
+                case DW_AT_call_line:       d->call_line = v.u; break;
+                case DW_AT_str_offsets_base: cu->str_offsets_base = v.u; break;
+                case DW_AT_addr_base:       cu->addr_base = v.u; break;
+                case DW_AT_rnglists_base:   cu->rnglists_base = v.u; break;
+                case DW_AT_stmt_list:       d->stmt_list = v.u; d->has_stmt_list = 1; break;
+                case DW_AT_comp_dir:        d->comp_dir = v; break;
+                }
+        }
+        d->next = p - dw.info->data;
+        return 0;
+}
+
+CU *cu_find(uint64_t off)
+{
+        int lo = 0, hi = dw.ncu - 1, mid;
+
+        while(lo <= hi)
+        {
+                mid = (lo + hi) / 2;
+                if(off < dw.cu[mid].off)
+                        hi = mid - 1;
+                else if(off >= dw.cu[mid].end)
+                        lo = mid + 1;
+                else
+                        return &dw.cu[mid];
+        }
+        return NULL;
+}
+
+/* Name of a function DIE, following abstract_origin/specification */
+const char *die_name(CU *cu, DIE *d)
+{
+        const char *name;
+        DIE o;
+        int hops;
+
+        for(hops=0;hops<8;hops++)
+        {
+                if(d->name.form && (name = val_str(cu, &d->name)))
+                        return name;
+                if(!d->origin || !(cu = cu_find(d->origin)) || die_read(cu, d->origin, &o) < 0)
+                        break;
+                d = &o;
+        }
+        return "";
+}
+
+/* Call fn for every [start, end) of d */
+void die_ranges(CU *cu, DIE *d, void (*fn)(uint64_t, uint64_t, void*), void *arg)
+{
+        uint64_t low, high, base = cu->low_pc, off, a, b;
+        const uint8_t *p, *end;
+        uint64_t amax = cu->addr_size == 4 ? 0xffffffffull : ~0ull;
+
+        if(d->has_low && d->has_high)
+        {
+                low = val_addr(cu, &d->low);
+                high = d->high.form == DW_FORM_addr || d->high.form == DW_FORM_addrx ||
+                       (d->high.form >= DW_FORM_addrx1 && d->high.form <= DW_FORM_addrx4) ?
+                       val_addr(cu, &d->high) : low + d->high.u;
+                if(low < high)
+                        fn(low, high, arg);
+                return;
+        }
+        if(!d->has_ranges)
+                return;
+        if(cu->version < 5)
+        {
+                if(!dw.ranges || d->ranges.u >= dw.ranges->size)
+                        return;
+                p = dw.ranges->data + d->ranges.u;
+                end = dw.ranges->data + dw.ranges->size;
+                while(p + 2 * cu->addr_size <= end)
+                {
+                        a = rd(&p, cu->addr_size);
+                        b = rd(&p, cu->addr_size);
+                        if(!a && !b)
+                                break;
+                        if(a == amax)
+                                base = b;
+                        else if(a < b)
+                                fn(base + a, base + b, arg);
+                }
+                return;
+        }
+        if(!dw.rnglists)
+                return;
+        off = d->ranges.u;
+        if(d->ranges.form == DW_FORM_rnglistx)
+        {
+                p = dw.rnglists->data + cu->rnglists_base + off * cu->offset_size;
+                if(p + cu->offset_size > dw.rnglists->data + dw.rnglists->size)
+                        return;
+                off = cu->rnglists_base + rd(&p, cu->offset_size);
+        }
+        if(off >= dw.rnglists->size)
+                return;
+        p = dw.rnglists->data + off;
+        end = dw.rnglists->data + dw.rnglists->size;
+        while(p < end)
+        {
+                switch(*p++)
+                {
+                case DW_RLE_end_of_list:
+                        return;
+                case DW_RLE_base_addressx:
+                        base = addr_index(cu, uleb(&p));
+                        break;
+                case DW_RLE_startx_endx:
+                        a = addr_index(cu, uleb(&p));
+                        b = addr_index(cu, uleb(&p));
+                        if(a < b)
+                                fn(a, b, arg);
+                        break;
+                case DW_RLE_startx_length:
+                        a = addr_index(cu, uleb(&p));
+                        b = uleb(&p);
+                        if(b)
+                                fn(a, a + b, arg);
+                        break;
+                case DW_RLE_offset_pair:
+                        a = uleb(&p);
+                        b = uleb(&p);
+                        if(a < b)
+                                fn(base + a, base + b, arg);
+                        break;
+                case DW_RLE_base_address:
+                        base = rd(&p, cu->addr_size);
+                        break;
+                case DW_RLE_start_end:
+                        a = rd(&p, cu->addr_size);
+                        b = rd(&p, cu->addr_size);
+                        if(a < b)
+                                fn(a, b, arg);
+                        break;
+                case DW_RLE_start_length:
+                        a = rd(&p, cu->addr_size);
+                        b = uleb(&p);
+                        if(b)
+                                fn(a, a + b, arg);
+                        break;
+                default:
+                        return;
+                }
+        }
+}
+
+void range_add(uint64_t start, uint64_t end, void *arg)
+{
+        uint32_t i = *(uint32_t*)arg;
+
+        range = grow(range, &range_cap, nrange + 1, sizeof(RANGE));
+        range[nrange].start = start;
+        range[nrange].end = end;
+        range[nrange].inl = i;
+        range[nrange].depth = inl_depth[i];
+        nrange++;
+}
+
+void subprogram_add(uint64_t start, uint64_t end, void *arg)
+{
+        if(!func_find(start))
+                func_add(start, end, (const char*)arg);
+}
+
+/* String for file index i of the unit's line table */
+uint32_t cu_file(CU *cu, uint64_t i)
+{
+        if(i < (uint64_t)cu->file_base || i - cu->file_base >= (uint64_t)cu->nfile)
+                return 0;
+        return cu->file[i - cu->file_base];
+}
+
+/* Line program header state while reading its tables */
+typedef struct line_hdr {
+        CU            *cu;
+        CU             unit;          /* cu with the header's sizes          */
+        const char   **dir;
+        int            ndir, dir_cap;
+        int            file_cap;
+} LINE_HDR;
+
+/* dir/name, with relative directories taken from comp_dir */
+uint32_t file_path(CU *cu, const char *dir, const char *name)
+{
+        char path[4096];
+
+        if(!name || !name[0])
+                return 0;
+        if(name[0] == '/' || !dir || !dir[0])
+                snprintf(path, sizeof(path), "%s", name);
+        else if(dir[0] == '/' || !cu->comp_dir)
+                snprintf(path, sizeof(path), "%s/%s", dir, name);
+        else
+                snprintf(path, sizeof(path), "%s/%s/%s", cu->comp_dir, dir, name);
+        return str_add(path);
+}
+
+void dir_add(LINE_HDR *lh, const char *dir)
+{
+        lh->dir = grow(lh->dir, &lh->dir_cap, lh->ndir + 1, sizeof(char*));
+        lh->dir[lh->ndir++] = dir;
+}
+
+void file_add(LINE_HDR *lh, uint64_t dir, const char *name)
+{
+        CU *cu = lh->cu;
+
+        cu->file = grow(cu->file, &lh->file_cap, cu->nfile + 1, sizeof(uint32_t));
+        cu->file[cu->nfile++] = file_path(cu, dir < (uint64_t)lh->ndir ?
+                                          lh->dir[dir] : NULL, name);
+}
+
+void row_add(uint64_t start, uint32_t file, uint32_t line, int end)
+{
+        row = grow(row, &row_cap, nrow + 1, sizeof(LINE_ROW));
+        row[nrow].start = start;
+        row[nrow].file = file;
+        row[nrow].line = line;
+        row[nrow].seq = nrow;
+        row[nrow].end = end;
+        nrow++;
+}
+
+/* DWARF 5 directory or file name table: entry formats, then entries */
+const uint8_t *line_entries5(LINE_HDR *lh, const uint8_t *p, int files)
+{
+        uint64_t fmt[16][2], nfmt, count, i, j, dir;
+        const char *name;
+        VAL v;
+
+        nfmt = *p++;
+        for(i=0;i<nfmt;i++)
+        {
+                fmt[i < 16 ? i : 15][0] = uleb(&p);
+                fmt[i < 16 ? i : 15][1] = uleb(&p);
+        }
+        count = uleb(&p);
+        for(i=0;i<count;i++)
+        {
+                name = NULL;
+                dir = 0;
+                for(j=0;j<nfmt && j<16;j++)
+                {
+                        read_form(&lh->unit, fmt[j][1], 0, &p, &v);
+                        if(fmt[j][0] == DW_LNCT_path)
+                                name = val_str(&lh->unit, &v);
+                        else if(fmt[j][0] == DW_LNCT_directory_index)
+                                dir = v.u;
+                }
+                if(files)
+                        file_add(lh, dir, name);
+                else
+                        dir_add(lh, name);
+        }
+        return p;
+}
+
+/*
+ * Run the unit's line number program, adding its rows.  Sequences
+ * starting at 0 (or the -1 tombstone) belong to discarded sections.
+ */
+void load_lines(CU *cu)
+{
+        const uint8_t *p, *end, *prog, *next;
+        const char *name;
+        uint8_t min_inst, line_range, opcode_base, lengths[256];
+        int8_t line_base;
+        uint64_t len, addr = 0, file = 1, seq_start = 0, n;
+        int64_t line = 1;
+        int version, seq_row, i;
+        LINE_HDR lh;
+
+        if(!dw.line || !cu->has_stmt_list || cu->stmt_list >= dw.line->size)
+                return;
+        memset(&lh, 0, sizeof(lh));
+        lh.cu = cu;
+        lh.unit = *cu;
+        p = dw.line->data + cu->stmt_list;
+        end = dw.line->data + dw.line->size;
+        len = rd(&p, 4);
+        lh.unit.offset_size = 4;
+        if(len == 0xffffffff)
+        {
+                len = rd(&p, 8);
+                lh.unit.offset_size = 8;
+        }
+        if(len > (uint64_t)(end - p))
+                return;
+        end = p + len;
+        version = rd(&p, 2);
+        if(version < 2 || version > 5)
+                return;
+        if(version >= 5)
+        {
+                lh.unit.addr_size = *p++;
+                p++;                            /* segment selector size */
+        }
+        len = rd(&p, lh.unit.offset_size);
+        prog = p + len;
+        min_inst = *p++;
+        if(version >= 4)
+                p++;                            /* max ops per instruction */
+        p++;                                    /* default is_stmt */
+        line_base = *p++;
+        line_range = *p++;
+        opcode_base = *p++;
+        memset(lengths, 0, sizeof(lengths));
+        for(i=1;i<opcode_base;i++)
+                lengths[i] = *p++;
+        if(!line_range)
+                return;
+
+        if(version >= 5)
+        {
+                cu->file_base = 0;
+                p = line_entries5(&lh, p, 0);
+                line_entries5(&lh, p, 1);
+        }
+        else
+        {
+                /* Directory 0 is the compilation directory */
+                cu->file_base = 1;
+                dir_add(&lh, cu->comp_dir);
+                while(p < prog && *p)
+                {
+                        dir_add(&lh, (const char*)p);
+                        p += strlen((const char*)p) + 1;
+                }
+                p++;
+                while(p < prog && *p)
+                {
+                        name = (const char*)p;
+                        p += strlen(name) + 1;
+                        n = uleb(&p);
+                        uleb(&p);
+                        uleb(&p);
+                        file_add(&lh, n, name);
+                }
+        }
+
+        p = prog;
+        seq_row = nrow;
+        while(p < end)
+        {
+                uint8_t op = *p++;
+
+                if(op >= opcode_base)
+                {
+                        op -= opcode_base;
+                        addr += (op / line_range) * min_inst;
+                        line += line_base + op % line_range;
+                        row_add(addr, cu_file(cu, file), line, 0);
+                        continue;
+                }
+                switch(op)
+                {
+                case 0:
+                        len = uleb(&p);
+                        next = p + len;
+                        if(!len || next > end)
+                                goto out;
+                        switch(*p++)
+                        {
+                        case DW_LNE_end_sequence:
+                                row_add(addr, 0, 0, 1);
+                                if(!seq_start || seq_start == ~0ull ||
+                                   (lh.unit.addr_size == 4 && seq_start == 0xffffffff))
+                                        nrow = seq_row;
+                                seq_row = nrow;
+                                addr = 0;
+                                file = 1;
+                                line = 1;
+                                break;
+                        case DW_LNE_set_address:
+                                addr = rd(&p, len - 1 <= 8 ? len - 1 : 8);
+                                if(nrow == seq_row)
+                                        seq_start = addr;
+                                break;
+                        case DW_LNE_define_file:
+                                name = (const char*)p;
+                                p += strlen(name) + 1;
+                                file_add(&lh, uleb(&p), name);
+                                break;
+                        }
+                        p = next;
+                        break;
+                case DW_LNS_copy:
+                        row_add(addr, cu_file(cu, file), line, 0);
+                        break;
+                case DW_LNS_advance_pc:
+                        addr += uleb(&p) * min_inst;
+                        break;
+                case DW_LNS_advance_line:
+                        line += sleb(&p);
+                        break;
+                case DW_LNS_set_file:
+                        file = uleb(&p);
+                        break;
+                case DW_LNS_const_add_pc:
+                        addr += ((255 - opcode_base) / line_range) * min_inst;
+                        break;
+                case DW_LNS_fixed_advance_pc:
+                        addr += rd(&p, 2);
+                        break;
+                default:
+                        for(i=0;i<lengths[op];i++)
+                                uleb(&p);
+                        break;
+                }
+        }
+out:
+        free(lh.dir);
+}
+
+int row_cmp(const void *a, const void *b)
+{
+        const LINE_ROW *x = a, *y = b;
+
+        if(x->start != y->start)
+                return x->start < y->start ? -1 : 1;
+        /* A sequence end gives way to a row starting there */
+        if(x->end != y->end)
+                return x->end ? -1 : 1;
+        return x->seq < y->seq ? -1 : 1;
+}
+
+/* Sort the rows, last row wins at an address, then merge equal runs */
+void build_lines(void)
+{
+        int i, n = 0;
+
+        qsort(row, nrow, sizeof(LINE_ROW), row_cmp);
+        for(i=0;i<nrow;i++)
+        {
+                if(n && row[n-1].start == row[i].start)
+                        n--;
+                if(n && row[n-1].file == row[i].file && row[n-1].line == row[i].line)
+                        continue;
+                row[n++] = row[i];
+        }
+        nrow = n;
+}
+
+/* Read every unit header and its unit DIE */
+void load_units(void)
+{
+        const uint8_t *p, *end, *q;
+        uint64_t len, abbrev_off;
+        CU *cu;
+        DIE d;
+        int cap = 0, unit_type;
+
+        p = dw.info->data;
+        end = p + dw.info->size;
+        while(p + 11 <= end)
+        {
+                dw.cu = grow(dw.cu, &cap, dw.ncu + 1, sizeof(CU));
+                cu = &dw.cu[dw.ncu];
+                memset(cu, 0, sizeof(*cu));
+                cu->off = p - dw.info->data;
+                cu->offset_size = 4;
+                len = rd(&p, 4);
+                if(len == 0xffffffff)
+                {
+                        len = rd(&p, 8);
+                        cu->offset_size = 8;
+                }
+                q = p;
+                if(len > (uint64_t)(end - p))
+                        break;
+                cu->end = (p - dw.info->data) + len;
+                cu->version = rd(&p, 2);
+                unit_type = 1;
+                if(cu->version >= 5)
+                {
+                        unit_type = *p++;
+                        cu->addr_size = *p++;
+                        abbrev_off = rd(&p, cu->offset_size);
+                        if(unit_type == 2 || unit_type == 6)    /* type units */
+                                p += 8 + cu->offset_size;
+                        else if(unit_type == 4 || unit_type == 5)
+                                p += 8;                         /* dwo id */
+                }
+                else
+                {
+                        abbrev_off = rd(&p, cu->offset_size);
+                        cu->addr_size = *p++;
+                }
+                p = q + len;
+                if(cu->version < 2 || cu->version > 5 ||
+                   (unit_type != 1 && unit_type != 3))
+                        continue;
+                cu->die = (q - dw.info->data) + (cu->version >= 5 ?
+                          2 + 2 + cu->offset_size : 2 + cu->offset_size + 1);
+                cu->abbrev = abbrev_table(abbrev_off);
+                if(die_read(cu, cu->die, &d) < 0)
+                        continue;
+                if(d.has_low)
+                        cu->low_pc = val_addr(cu, &d.low);
+                cu->has_stmt_list = d.has_stmt_list;
+                cu->stmt_list = d.stmt_list;
+                cu->comp_dir = d.comp_dir.form ? val_str(cu, &d.comp_dir) : NULL;
+                dw.ncu++;
+        }
+}
+
+/* Walk every DIE, collecting subprograms and inline instances */
+void load_dies(void)
+{
+        uint32_t parent[MAX_DIE_DEPTH], idx;
+        uint64_t off;
+        CU *cu;
+        DIE d;
+        int i, depth;
+
+        for(i=0;i<dw.ncu;i++)
+        {
+                cu = &dw.cu[i];
+                off = cu->die;
+                depth = 0;
+                parent[0] = SFI_NONE;
+                while(die_read(cu, off, &d) == 0)
+                {
+                        off = d.next;
+                        if(!d.tag)
+                        {
+                                if(--depth <= 0)
+                                        break;
+                                continue;
+                        }
+                        idx = parent[depth];
+                        if(d.tag == DW_TAG_subprogram)
+                        {
+                                idx = SFI_NONE;
+                                die_ranges(cu, &d, subprogram_add, (void*)die_name(cu, &d));
+                        }
+                        else if(d.tag == DW_TAG_inlined_subroutine)
+                        {
+                                inl = grow(inl, &inl_cap, ninl + 1, sizeof(SFI_INLINE));
+                                inl_depth = realloc(inl_depth, inl_cap * sizeof(uint32_t));
+                                inl[ninl].name = str_add(die_name(cu, &d));
+                                inl[ninl].parent = parent[depth];
+                                inl[ninl].call_file = cu_file(cu, d.call_file);
+                                inl[ninl].call_line = d.call_line;
+                                inl_depth[ninl] = parent[depth] == SFI_NONE ? 1 :
+                                                  inl_depth[parent[depth]] + 1;
+                                idx = ninl++;
+                                die_ranges(cu, &d, range_add, &idx);
+                        }
+                        if(d.children)
+                        {
+                                if(++depth >= MAX_DIE_DEPTH)
+                                        break;
+                                parent[depth] = idx;
+                        }
+                        else if(depth == 0)
+                                break;
+                }
+        }
+}
+
+/*
+ * Flatten the nested inline ranges into SFI_SEGs: at every boundary the
+ * deepest range still open is the innermost inline frame.
+ */
+typedef struct event {
+        uint64_t       pos;
+        int            open;
+        uint32_t       r;
+} EVENT;
+
+int event_cmp(const void *a, const void *b)
+{
+        const EVENT *x = a, *y = b;
+
+        if(x->pos != y->pos)
+                return x->pos < y->pos ? -1 : 1;
+        return x->open - y->open;       /* Close before open */
+}
+
+void seg_add(uint64_t start, uint32_t in)
+{
+        if(nseg && seg[nseg-1].inl == in)
+                return;
+        if(nseg && seg[nseg-1].start == start)
+        {
+                seg[nseg-1].inl = in;
+                if(nseg > 1 && seg[nseg-2].inl == in)
+                        nseg--;
+                return;
+        }
+        seg = grow(seg, &seg_cap, nseg + 1, sizeof(SFI_SEG));
+        seg[nseg].start = start;
+        seg[nseg].inl = in;
+        seg[nseg].pad = 0;
+        nseg++;
+}
+
+void build_segments(void)
+{
+        EVENT *ev = malloc(2 * nrange * sizeof(EVENT) + 1);
+        uint32_t *open = NULL, best;
+        int i, j, nopen = 0, open_cap = 0;
+
+        for(i=0;i<nrange;i++)
+        {
+                ev[2*i].pos = range[i].start;
+                ev[2*i].open = 1;
+                ev[2*i].r = i;
+                ev[2*i+1].pos = range[i].end;
+                ev[2*i+1].open = 0;
+                ev[2*i+1].r = i;
+        }
+        qsort(ev, 2 * nrange, sizeof(EVENT), event_cmp);
+        for(i=0;i<2*nrange;i++)
+        {
+                if(ev[i].open)
+                {
+                        open = grow(open, &open_cap, nopen + 1, sizeof(uint32_t));
+                        open[nopen++] = ev[i].r;
+                }
+                else
+                {
+                        for(j=0;j<nopen;j++)
+                                if(open[j] == ev[i].r)
+                                {
+                                        open[j] = open[--nopen];
+                                        break;
+                                }
+                }
+                if(i + 1 < 2 * nrange && ev[i+1].pos == ev[i].pos)
+                        continue;
+                best = SFI_NONE;
+                for(j=0;j<nopen;j++)
+                        if(best == SFI_NONE || range[open[j]].depth > range[best].depth)
+                                best = open[j];
+                seg_add(ev[i].pos, best == SFI_NONE ? SFI_NONE : range[best].inl);
+        }
+        free(ev);
+        free(open);
+}
+
+void load_dwarf(ELF_FILE *e)
+{
+        int i;
+
+        memset(&dw, 0, sizeof(dw));
+        dw.info = elf_section(e, ".debug_info");
+        dw.abbrev = elf_section(e, ".debug_abbrev");
+        dw.str = elf_section(e, ".debug_str");
+        dw.line_str = elf_section(e, ".debug_line_str");
+        dw.ranges = elf_section(e, ".debug_ranges");
+        dw.rnglists = elf_section(e, ".debug_rnglists");
+        dw.str_offsets = elf_section(e, ".debug_str_offsets");
+        dw.addr = elf_section(e, ".debug_addr");
+        dw.line = elf_section(e, ".debug_line");
+        if(!dw.info || !dw.abbrev)
+                return;
+        load_units();
+        for(i=0;i<dw.ncu;i++)
+                load_lines(&dw.cu[i]);
+        load_dies();
+        build_segments();
+        build_lines();
+}
+
+/* ---- output ---- */
+
+int write_index(const char *dir, uint8_t *id, int id_size)
+{
+        char path[4096], tmp[4096 + 16];
+        SFI_HDR h;
+        uint32_t off;
+        FILE *f;
+        int i, n;
+
+        n = snprintf(path, sizeof(path), "%s/", dir);
+        for(i=0;i<id_size;i++)
+                n += snprintf(path + n, sizeof(path) - n, "%02x", id[i]);
+        snprintf(path + n, sizeof(path) - n, ".sfi");
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+        memset(&h, 0, sizeof(h));
+        h.magic = SFI_MAGIC;
+        h.version = SFI_VERSION;
+        h.id_size = id_size;
+        memcpy(h.id, id, id_size);
+        off = (sizeof(h) + 7) & ~7;
+        h.nfunc = nfunc;        h.func_off = off;       off += nfunc * sizeof(SFI_FUNC);
+        h.nseg = nseg;          h.seg_off = off;        off += nseg * sizeof(SFI_SEG);
+        h.ninline = ninl;       h.inline_off = off;     off += ninl * sizeof(SFI_INLINE);
+        h.nline = nrow;         h.line_off = off;       off += nrow * sizeof(SFI_LINE);
+        h.str_off = off;        h.str_size = pool.len;
+
+        /* Written aside and renamed, so readers never map half a file */
+        f = fopen(tmp, "w");
+        if(!f)
+        {
+                perror(tmp);
+                return -1;
+        }
+        fwrite(&h, sizeof(h), 1, f);
+        for(i=sizeof(h);i<(int)h.func_off;i++)
+                fputc(0, f);
+        fwrite(func, sizeof(SFI_FUNC), nfunc, f);
+        fwrite(seg, sizeof(SFI_SEG), nseg, f);
+        fwrite(inl, sizeof(SFI_INLINE), ninl, f);
+        for(i=0;i<nrow;i++)
+        {
+                SFI_LINE l = { row[i].start, row[i].file, row[i].line };
+
+                fwrite(&l, sizeof(l), 1, f);
+        }
+        fwrite(pool.buf, 1, pool.len, f);
+        if(fclose(f) || rename(tmp, path))
+        {
+                perror(path);
+                unlink(tmp);
+                return -1;
+        }
+        printf("%s: %d functions, %d inline instances, %d segments, %d lines, "
+               "%u bytes of strings\n", path, nfunc, ninl, nseg, nrow, pool.len);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        ELF_FILE bin, dbg, *src;
+        uint8_t id[SFI_ID_MAX];
+        char *dir = ".";
+        int opt, id_size;
+
+        while((opt = getopt(argc, argv, "o:")) != -1)
+        {
+                if(opt == 'o')
+                        dir = optarg;
+                else
+                {
+                        fprintf(stderr, "usage: %s [-o dir] binary [debugfile]\n", argv[0]);
+                        return 1;
+                }
+        }
+        if(optind >= argc)
+        {
+                fprintf(stderr, "usage: %s [-o dir] binary [debugfile]\n", argv[0]);
+                return 1;
+        }
+        if(elf_open(&bin, argv[optind]) < 0)
+                return 1;
+        id_size = elf_build_id(&bin, id);
+        if(!id_size)
+        {
+                fprintf(stderr, "%s: no GNU build-id, link with --build-id\n", argv[optind]);
+                return 1;
+        }
+        src = &bin;
+        if(optind + 1 < argc)
+        {
+                if(elf_open(&dbg, argv[optind+1]) < 0)
+                        return 1;
+                src = &dbg;
+        }
+
+        pool.buf = malloc(1);
+        pool.buf[0] = 0;
+        pool.len = pool.cap = 1;
+        load_symtab(&bin);
+        if(!nfunc && src != &bin)
+                load_symtab(src);
+        func_finish();
+        load_dwarf(src);
+        func_finish();
+        return write_index(dir, id, id_size) < 0;
+}
@@ -0,0 +1,96 @@
+#ifndef SYMIDX_H
+#define SYMIDX_H
+
+#include <stdint.h>
+
+/*
+ * Symbol index (.sfi) file, written by the symidx tool and mapped read
+ * only by stack_resolve().  One file per object, named after its GNU
+ * build-id in hex.  Everything is an offset from the start of the file
+ * and every address is link time (runtime pc minus load bias), so the
+ * same page cached copy serves any number of processes.
+ *
+ *   SFI_HDR
+ *   SFI_FUNC[nfunc]       sorted by start
+ *   SFI_SEG[nseg]         sorted by start, each runs up to the next one
+ *   SFI_INLINE[ninline]   inline instances, referenced by segments
+ *   SFI_LINE[nline]       .debug_line rows, sorted by start, same
+ *   string pool           NUL terminated, offset 0 is ""
+ *
+ * A pc's inline chain is the SFI_INLINE of the segment covering it, then
+ * its parents; the function containing them all comes from SFI_FUNC.
+ * The line row covering pc gives the innermost frame's file:line, each
+ * SFI_INLINE's call site gives that of the frame it was inlined into.
+ */
+#define SFI_MAGIC       0x31494653    /* "SFI1" */
+#define SFI_VERSION     2
+#define SFI_ID_MAX      32
+#define SFI_NONE        0xffffffff
+
+typedef struct {
+        uint32_t       magic;
+        uint32_t       version;
+        uint32_t       id_size;
+        uint8_t        id[SFI_ID_MAX];    /* GNU build-id of the object      */
+        uint32_t       nfunc, func_off;
+        uint32_t       nseg, seg_off;
+        uint32_t       ninline, inline_off;
+        uint32_t       nline, line_off;
+        uint32_t       str_off, str_size;
+} SFI_HDR;
+
+typedef struct {
+        uint64_t       start;
+        uint64_t       end;
+        uint32_t       name;
+        uint32_t       pad;
+} SFI_FUNC;
+
+typedef struct {
+        uint64_t       start;
+        uint32_t       inl;               /* Innermost SFI_INLINE or SFI_NONE */
+        uint32_t       pad;
+} SFI_SEG;
+
+typedef struct {
+        uint32_t       name;              /* Inlined function                */
+        uint32_t       parent;            /* Enclosing inline or SFI_NONE    */
+        uint32_t       call_file;         /* Where it was inlined, string    */
+        uint32_t       call_line;
+} SFI_INLINE;
+
+typedef struct {
+        uint64_t       start;
+        uint32_t       file;              /* Path string, 0 for no line      */
+        uint32_t       line;
+} SFI_LINE;
+
+/*
+ * Check an index mapped from a file of size bytes before any table is
+ * searched: header, every table and the string pool inside the file, the
+ * pool starting with "" and NUL terminated.  A truncated or foreign file fails.  Returns 1 if
+ * the index is usable.  String offsets are checked where used, through
+ * sfi_str().
+ */
+static inline int sfi_valid(const SFI_HDR *h, uint64_t size)
+{
+        if(size < sizeof(SFI_HDR) || h->magic != SFI_MAGIC || h->version != SFI_VERSION ||
+           h->id_size > SFI_ID_MAX)
+                return 0;
+        if(h->func_off + (uint64_t)h->nfunc * sizeof(SFI_FUNC) > size ||
+           h->seg_off + (uint64_t)h->nseg * sizeof(SFI_SEG) > size ||
+           h->inline_off + (uint64_t)h->ninline * sizeof(SFI_INLINE) > size ||
+           h->line_off + (uint64_t)h->nline * sizeof(SFI_LINE) > size ||
+           h->str_off + (uint64_t)h->str_size > size || !h->str_size)
+                return 0;
+        return !((const char *)h)[h->str_off] &&
+               !((const char *)h)[h->str_off + h->str_size - 1];
+}
+
+/* String at off in the pool of a checked index, "" if off is outside it */
+static inline const char *sfi_str(const SFI_HDR *h, uint32_t off)
+{
+        return (const char *)h + h->str_off + (off < h->str_size ? off : 0);
+}
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Stall watchdog, see watchdog.h.
+ *
+ * The watchdog thread wakes every period and compares each slot's beat
+ * with the value it saw last.  Progress resets the clock; a beat that
+ * stays put past the deadline is a stall, reported once until the thread
+ * moves again.  Stacks are taken by the threads themselves: the watchdog
+ * sends WATCHDOG_SIG and the handler walks the EBP chain starting at the
+ * interrupted EIP/EBP from the signal context.  The handler also keeps
+ * the context itself, and the core is written later by the watchdog
+ * thread, never from the handler.
+ *
+ * That only moves the work off the stalled thread; the watchdog thread
+ * still needs what the report and dump use.  Reports are formatted with
+ * snprintf() and written with write(2), so they do not need the stdio
+ * locks, but symbolizing takes the loader's lock (dladdr(),
+ * dl_iterate_phdr()).  dump_core_context() walks the loaded objects the
+ * same way, starts the writer threads with pthread_create() and prints
+ * its result line on stdout.  A thread stalled inside dlopen(), thread
+ * creation or a stdout write hangs the watchdog as well.  The malloc
+ * arenas are read without their locks, so a thread stalled in malloc()
+ * only risks a heap caught mid-update.  With the dump helper
+ * (dump_helper_start()) the core is read and written by another process
+ * and only the object walk is left in this one.
+ *
+ * A slot's used is 1 while registered; the watchdog raises it to 2 for
+ * the pthread_kill() so the thread cannot unregister and exit under it.
+ *
+ *   gcc -m32 -g -fno-omit-frame-pointer -DSEGMENT_NO_MAIN -DSTACK_NO_MAIN \
+ *       app.c watchdog.c stack.c segment.c -o app -lpthread -ldl
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "segment.h"
+#include "watchdog.h"
+
+#define WATCHDOG_SIG    (SIGRTMIN + 3)
+
+/* Linked in only when segment.c is */
+void dump_core_context(char *filename, int tid, ucontext_t *uc, siginfo_t *info) __attribute__((weak));
+
+WATCHDOG_SLOT watchdog_slot[WATCHDOG_THREADS];
+__thread WATCHDOG_SLOT *watchdog_self;
+char *watchdog_core;
+volatile unsigned long watchdog_stalls;
+unsigned long long watchdog_period_ns;
+pthread_t watchdog_thread;
+volatile int watchdog_stalled;       /* tid the watchdog is reporting    */
+
+unsigned long long watchdog_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void watchdog_signal(int sig, siginfo_t *info, void *ctx)
+{
+        ucontext_t *uc = (ucontext_t*)ctx;
+        WATCHDOG_SLOT *s = watchdog_self;
+        unsigned long *frame;
+
+        if(!s)
+                return;
+#ifdef __x86_64__
+        s->pc[0] = uc->uc_mcontext.gregs[REG_RIP];
+        frame = (unsigned long*)uc->uc_mcontext.gregs[REG_RBP];
+#else
+        s->pc[0] = uc->uc_mcontext.gregs[REG_EIP];
+        frame = (unsigned long*)uc->uc_mcontext.gregs[REG_EBP];
+#endif
+        s->depth = 1 + stack_walk(frame, &s->pc[1], STACK_MAX_DEPTH - 1);
+        if(watchdog_core && watchdog_stalled == s->tid)
+        {
+                s->uc = *uc;
+                s->info = *info;
+                if(uc->uc_mcontext.fpregs)
+                {
+                        memcpy(s->fpstate, uc->uc_mcontext.fpregs, sizeof(s->fpstate));
+                        s->uc.uc_mcontext.fpregs = (void*)s->fpstate;
+                }
+        }
+        __sync_synchronize();
+        s->sampled = 1;
+}
+
+void watchdog_report(WATCHDOG_SLOT *s, char *what, unsigned long long ms)
+{
+        char line[128];
+        int n;
+
+        n = snprintf(line, sizeof(line), "watchdog: thread %d (%s) %s, last beat %llu ms ago%s\n",
+                     s->tid, s->name, what, ms, s->sampled ? "" : ", no sample");
+        write(2, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+        if(s->sampled)
+                stack_print(2, s->pc, s->depth, 1);
+}
+
+/* Sample every registered thread, stalled one first */
+void watchdog_stall(WATCHDOG_SLOT *stalled, unsigned long long now)
+{
+        unsigned long long until;
+        int i, pending;
+
+        watchdog_stalls++;
+        watchdog_stalled = stalled->tid;
+        for(i=0;i<WATCHDOG_THREADS;i++)
+        {
+                watchdog_slot[i].sampled = 0;
+                if(__sync_bool_compare_and_swap(&watchdog_slot[i].used, 1, 2))
+                {
+                        pthread_kill(watchdog_slot[i].thread, WATCHDOG_SIG);
+                        watchdog_slot[i].used = 1;
+                }
+        }
+        until = watchdog_ns() + WATCHDOG_WAIT_NS;
+        do
+        {
+                pending = 0;
+                for(i=0;i<WATCHDOG_THREADS;i++)
+                        if(watchdog_slot[i].used == 1 && !watchdog_slot[i].sampled)
+                                pending++;
+                if(pending)
+                        usleep(1000);
+        }while(pending && watchdog_ns() < until);
+
+        watchdog_report(stalled, "stalled", (now - stalled->since_ns) / 1000000);
+        for(i=0;i<WATCHDOG_THREADS;i++)
+                if(watchdog_slot[i].used == 1 && &watchdog_slot[i] != stalled)
+                        watchdog_report(&watchdog_slot[i], "running",
+                                        (now - watchdog_slot[i].since_ns) / 1000000);
+        if(watchdog_core && dump_core_context && stalled->sampled)
+                dump_core_context(watchdog_core, stalled->tid, &stalled->uc, &stalled->info);
+        watchdog_stalled = 0;
+}
+
+void *watchdog_main(void *arg)
+{
+        struct timespec ts;
+        unsigned long long now;
+        unsigned long beat;
+        WATCHDOG_SLOT *s;
+        int i;
+
+        prctl(PR_SET_NAME, "watchdog", 0L, 0L, 0L);
+        ts.tv_sec = watchdog_period_ns / 1000000000;
+        ts.tv_nsec = watchdog_period_ns % 1000000000;
+        while(1)
+        {
+                nanosleep(&ts, NULL);
+                now = watchdog_ns();
+                for(i=0;i<WATCHDOG_THREADS;i++)
+                {
+                        s = &watchdog_slot[i];
+                        if(s->used != 1)
+                                continue;
+                        beat = __atomic_load_n(&s->beat, __ATOMIC_RELAXED);
+                        if(beat != s->seen || !s->since_ns)
+                        {
+                                s->seen = beat;
+                                s->since_ns = now;
+                                s->reported = 0;
+                        }
+                        else if(!s->reported && now - s->since_ns > s->deadline_ns)
+                        {
+                                s->reported = 1;
+                                watchdog_stall(s, now);
+                        }
+                }
+        }
+        return NULL;
+}
+
+int watchdog_start(unsigned long long period_ns)
+{
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = watchdog_signal;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(WATCHDOG_SIG, &sa, NULL) < 0)
+        {
+                perror("watchdog sigaction failed");
+                return -1;
+        }
+        watchdog_period_ns = period_ns;
+        if(pthread_create(&watchdog_thread, NULL, watchdog_main, NULL))
+        {
+                perror("watchdog thread failed");
+                return -1;
+        }
+        return 0;
+}
+
+/* Returns -1 if every slot is taken */
+int watchdog_register(unsigned long long deadline_ns)
+{
+        WATCHDOG_SLOT *s;
+        int i;
+
+        /* The signal handler walks our stack, look its bounds up here */
+        stack_bounds();
+        for(i=0;i<WATCHDOG_THREADS;i++)
+        {
+                s = &watchdog_slot[i];
+                if(s->used || !__sync_bool_compare_and_swap(&s->used, 0, -1))
+                        continue;
+                s->tid = syscall(SYS_gettid);
+                s->thread = pthread_self();
+                prctl(PR_GET_NAME, s->name, 0L, 0L, 0L);
+                s->deadline_ns = deadline_ns;
+                s->since_ns = 0;
+                s->reported = 0;
+                watchdog_self = s;
+                __sync_synchronize();
+                s->used = 1;
+                return 0;
+        }
+        return -1;
+}
+
+void watchdog_unregister(void)
+{
+        WATCHDOG_SLOT *s = watchdog_self;
+
+        if(!s)
+                return;
+        watchdog_self = NULL;
+        /* Wait out a pthread_kill() aimed at us */
+        while(!__sync_bool_compare_and_swap(&s->used, 1, 0))
+                sched_yield();
+}
@@ -0,0 +1,59 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#include "stack.h"
+
+/*
+ * Stall watchdog.  A thread registers with a deadline and calls
+ * watchdog_beat() whenever it makes progress.  If its beat does not move
+ * for the deadline, the watchdog thread signals every registered thread,
+ * each walks its own stack from the interrupted frame, and a symbolized
+ * report goes to stderr.  With watchdog_core set the watchdog thread then
+ * writes a core with dump_core_context(), the stalled thread's sampled
+ * context first.  Symbolizing and dumping take the loader's lock, so a
+ * thread stalled holding it hangs the watchdog too; see watchdog.c.
+ */
+#define WATCHDOG_THREADS 256
+#define WATCHDOG_WAIT_NS (100*1000000ULL)  /* for threads to take a sample */
+#define WATCHDOG_FPSTATE 640          /* i386 legacy FPU part plus fxsave    */
+
+typedef struct
+{
+        volatile unsigned long beat;  /* Written by the owner only           */
+        volatile int   used;          /* 0 free, -1 setup, 1 in use, 2 pinned */
+        int            tid;
+        pthread_t      thread;
+        char           name[16];
+        unsigned long long deadline_ns;
+        unsigned long  seen;          /* Watchdog side: last beat seen       */
+        unsigned long long since_ns;  /* ... and when it changed             */
+        int            reported;
+        volatile int   sampled;
+        int            depth;
+        unsigned long  pc[STACK_MAX_DEPTH];
+        ucontext_t     uc;            /* Stalled thread's context, for cores */
+        siginfo_t      info;
+        unsigned char  fpstate[WATCHDOG_FPSTATE] __attribute__((aligned(16)));
+} __attribute__((aligned(64))) WATCHDOG_SLOT;
+
+extern __thread WATCHDOG_SLOT *watchdog_self;
+extern char *watchdog_core;
+extern volatile unsigned long watchdog_stalls;
+
+int watchdog_start(unsigned long long period_ns);
+int watchdog_register(unsigned long long deadline_ns);
+void watchdog_unregister(void);
+
+/* Fast path: one relaxed store, no lock and no read-modify-write */
+static inline void watchdog_beat(void)
+{
+        WATCHDOG_SLOT *s = watchdog_self;
+
+        if(s)
+                __atomic_store_n(&s->beat, s->beat + 1, __ATOMIC_RELAXED);
+}
+
+#endif